@@ -13,6 +13,20 @@
 // struct pipe *pipe_create(uint size)
 //      - creates an object of type pipe and create buffer of size 'size'. Buffer
 //        will be used for communication from one pipe to another pipe.
+//      - any number of threads can write to and read from the pipe.
+//      - returns pointer to the created pipe.
+//
+// struct pipe *pipe_create_spsc(uint size)
+//      - same as pipe_create, but the pipe can be used only by one writing thread
+//        and one reading thread at a time. Reads and writes do not take any lock.
+//      - returns pointer to the created pipe.
+//
+// struct pipe *pipe_create_mpmc(uint size, uint atomic_size)
+//      - same as pipe_create, but writers and readers do not share any lock, they
+//        reserve their part of the buffer with an atomic operation. Every write
+//        of at most 'atomic_size' bytes is stored in the buffer as one piece and
+//        it is never interleaved with data of other writers. Longer writes are
+//        split into pieces of 'atomic_size' bytes.
 //      - returns pointer to the created pipe.
 //
 // uint pipe_write(struct pipe *p, unsigned char *data, uint size)
@@ -29,6 +43,169 @@
 //        in the buffer.
 //      - returns number of bytes read from the buffer.
 //
+// bool pipe_write_reserve(struct pipe *p, uint min, unsigned char **data, uint *size)
+//      - waits until there are at least 'min' free bytes in the buffer and stores
+//        the first continuous free part of the buffer to 'data' and its length to
+//        'size'. The part is shorter than 'min' only if the free space continues
+//        from the start of the buffer. The caller writes directly to the buffer and
+//        then must call pipe_write_commit. Other writers wait until then.
+//      - returns false if the pipe is closed.
+//
+// void pipe_write_commit(struct pipe *p, uint size)
+//      - makes first 'size' bytes of the part returned by pipe_write_reserve
+//        readable. 'size' can be smaller than the reserved size, even 0.
+//
+// bool pipe_read_peek(struct pipe *p, unsigned char **data, uint *size)
+//      - waits until there are some data in the buffer and stores the first
+//        continuous part of them to 'data' and its length to 'size'. The caller
+//        reads directly from the buffer and then must call pipe_read_consume.
+//        Other readers wait until then.
+//      - returns false if the pipe is closed and there is nothing to read.
+//
+// void pipe_read_consume(struct pipe *p, uint size)
+//      - frees first 'size' bytes of the part returned by pipe_read_peek, 'size'
+//        can be smaller than the peeked size, even 0.
+//
+// ssize_t pipe_fill_from_fd(struct pipe *p, int fd, size_t max)
+//      - waits until there is some free space in the buffer and reads at most
+//        'max' bytes from the file descriptor 'fd' directly to the buffer with one
+//        readv call.
+//      - returns number of bytes read, 0 at the end of the file and -1 on error
+//        (errno is set, EPIPE if the pipe is closed). 'max' 0 returns 0 without
+//        reading, so 0 means the end of the file only for a positive 'max'.
+//      - the write lock is not held during the readv, other writers sleep until
+//        it returns.
+//
+// ssize_t pipe_drain_to_fd(struct pipe *p, int fd, size_t max)
+//      - waits until there are some data in the buffer and writes at most 'max'
+//        bytes of them to the file descriptor 'fd' directly from the buffer with
+//        one writev call.
+//      - returns number of bytes written, 0 if the pipe is closed and there is
+//        nothing to write and -1 on error (errno is set). 'max' 0 returns 0
+//        without writing.
+//      - the read lock is not held during the writev, other readers sleep until
+//        it returns.
+//
+// Reserve/commit, peek/consume and the file descriptor functions are not
+// available for MPMC pipes.
+//
+// struct pipe *pipe_create_mirrored(uint size, enum pipe_mode mode)
+//      - creates pipe of the given mode (PIPE_MODE_LOCKED like pipe_create,
+//        PIPE_MODE_SPSC like pipe_create_spsc or PIPE_MODE_MPMC like
+//        pipe_create_mpmc with 'atomic_size' equal to 'size') whose buffer is
+//        mapped twice in a row in the memory. Any part of the buffer is then
+//        continuous, reads and writes are always one memcpy and
+//        pipe_write_reserve always returns at least 'min' bytes. 'size' is
+//        rounded up to the page size.
+//      - returns pointer to the created pipe.
+//
+// struct pipe *pipe_create_elastic(uint min, uint max, enum pipe_mode mode)
+//      - creates pipe of the given mode (PIPE_MODE_LOCKED or PIPE_MODE_SPSC) with
+//        buffer of 'min' bytes. When a writer would wait for space, the pipe moves
+//        to a buffer twice as large instead, up to 'max' bytes. When the buffer
+//        stays at most a quarter full for 100 ms, the pipe moves to a buffer half
+//        as large, down to 'min' bytes. Writers and readers check it, readers
+//        waiting for data wake up to check it too, so an idle pipe gives its
+//        memory back. Readers read the old buffer to the end, so no data are
+//        reordered and readers never wait for the move. The old buffer is freed
+//        later, when no waiting thread can look at it.
+//      - returns pointer to the created pipe.
+//
+// struct pipe *pipe_create_shared(const char *name, uint size)
+//      - same as pipe_create, but the pipe is placed in a new shared memory object
+//        'name' (see shm_open) together with its locks, so it can be used by
+//        threads of other processes which open it with pipe_open_shared. 'size'
+//        is rounded up to the page size.
+//      - returns pointer to the created pipe.
+//
+// struct pipe *pipe_create_shared_mode(const char *name, uint size, enum pipe_mode mode,
+//                                      bool mirrored)
+//      - same as pipe_create_shared, but the pipe is of the given mode and its
+//        buffer is mapped twice if 'mirrored' (see pipe_create_mirrored).
+//      - returns pointer to the created pipe.
+//
+// struct pipe *pipe_open_shared(const char *name)
+//      - opens the pipe created by pipe_create_shared in other process. Waits
+//        until the other process creates it, at most for one second. Reads,
+//        writes and closing work the same way as in one process. Shared pipes
+//        can not be used with wait-sets and eventfd. Both processes must be
+//        built with the same PIPE_STATS setting.
+//      - returns pointer to the opened pipe.
+//
+// bool pipe_send_msg(struct pipe *p, unsigned char *data, uint size)
+//      - writes 'size' bytes from 'data' to the pipe 'p' as one message. The
+//        message is stored with its length and it is read only as a whole by
+//        pipe_recv_msg. Waits until there is space for the whole message.
+//      - returns false if the pipe is closed.
+//
+// int pipe_recv_msg(struct pipe *p, unsigned char *data, uint size, uint *length)
+//      - waits for a message, copies it to 'data' and stores its length to
+//        'length'.
+//      - returns 1, 0 if the pipe is closed and there is no message and -1 if the
+//        message is longer than 'size' (see pipe_recv_msgs).
+//
+// int pipe_recv_msgs(struct pipe *p, unsigned char *data, uint size, uint *lengths,
+//                    uint count)
+//      - waits for a message and then reads as many whole messages as fit to 'size'
+//        bytes of 'data' (at most 'count'). Messages are stored in 'data' one after
+//        another, their lengths are stored to 'lengths'.
+//      - returns number of read messages, 0 if the pipe is closed and there is no
+//        message and -1 if the first message is longer than 'size'. Then errno is
+//        EMSGSIZE, the length of the message is stored to 'lengths[0]' and the
+//        message stays in the pipe, it can be received with a larger buffer.
+//
+// bool pipe_peek_msg_size(struct pipe *p, uint *length)
+//      - waits for a message and stores its length to 'length' without reading it.
+//      - returns false if the pipe is closed and there is no message.
+//
+// A pipe must be used either for messages or for bytes (pipe_write, pipe_read and
+// the zero-copy functions), never for both.
+//
+// uint pipe_try_write(struct pipe *p, unsigned char *data, uint size)
+// uint pipe_try_read(struct pipe *p, unsigned char *data, uint size)
+//      - same as pipe_write and pipe_read, but never wait. They move only as many
+//        bytes as there is space or data in the buffer right now.
+//      - returns number of bytes written or read.
+//
+// struct pipe_waitset *pipe_waitset_create()
+//      - creates a wait-set, an object which one thread uses to wait for many
+//        pipes at once.
+//
+// void pipe_waitset_add(struct pipe_waitset *ws, struct pipe *p, int events)
+//      - starts watching the pipe 'p' for 'events', which is PIPE_READABLE,
+//        PIPE_WRITABLE or both. Closing of the pipe is always reported.
+//
+// void pipe_waitset_remove(struct pipe_waitset *ws, struct pipe *p)
+//      - stops watching the pipe 'p'. A pipe must be removed from all wait-sets
+//        before pipe_free.
+//
+// int pipe_waitset_wait(struct pipe_waitset *ws, struct pipe_ready *ready, int count,
+//                       int timeout)
+//      - waits until some of the watched pipes is ready (it has data, it has space
+//        or it is closed) or 'timeout' milliseconds pass (negative 'timeout'
+//        waits forever). Stores at most 'count' ready pipes with their events
+//        (PIPE_READABLE, PIPE_WRITABLE, PIPE_CLOSED) to 'ready'.
+//      - returns number of ready pipes, 0 on timeout.
+//
+// void pipe_waitset_free(struct pipe_waitset *ws)
+//      - stops watching all pipes and frees the wait-set.
+//
+// int pipe_eventfd(struct pipe *p)
+//      - returns eventfd which becomes readable when data are written to the pipe
+//        or the pipe is closed, so the pipe can be watched by epoll together with
+//        sockets. When epoll reports the eventfd, call pipe_eventfd_ack and then
+//        read the pipe with pipe_try_read until it is empty. The eventfd is
+//        closed by pipe_free.
+//
+// void pipe_eventfd_ack(struct pipe *p)
+//      - resets the eventfd of the pipe, must be called before the pipe is read.
+//
+// void pipe_set_wait(struct pipe *p, enum pipe_wait wait, uint spin)
+//      - sets how threads blocked in pipe_write and pipe_read wait. PIPE_WAIT_SPIN
+//        busy-waits, PIPE_WAIT_FUTEX (default) spins 'spin' times and then sleeps
+//        on a futex, PIPE_WAIT_CONDVAR spins 'spin' times and then sleeps on
+//        a condition variable. Must be called before the pipe is used.
+//
 // void pipe_close(struct pipe *p)
 //      - closes the pipe 'p'. All threads that are waiting for data in the pipe
 //        will be woken up and after close function pipe_write and pipe_read
@@ -37,18 +214,107 @@
 //        called, then the thread will be woken up and the function will return 0 or
 //        return real number of bytes written to the buffer.
 //
+// void pipe_stats(struct pipe *p, struct pipe_stats *stats)
+//      - stores statistics of the pipe 'p' to 'stats'. For writes and for reads
+//        there are the number of bytes and calls which moved them, the number and
+//        the total time of waits for space or data, the number of spin
+//        iterations while waiting and a histogram of the time of blocking calls
+//        in buckets of powers of two nanoseconds. 'high_water' is the most bytes
+//        that were ever in the buffer.
+//      - available only if compiled with -DPIPE_STATS, otherwise the pipe does
+//        not measure anything.
+//
+// void pipe_stats_reset(struct pipe *p)
+//      - sets all statistics of the pipe 'p' to zero (only with -DPIPE_STATS).
+//
 // void pipe_free(struct pipe *p)
-//      - frees the pipe 'p' and all resources that are used by the pipe.
+//      - frees the pipe 'p' and all resources that are used by the pipe. Shared
+//        pipe is only unmapped, its shared memory object is removed when it is
+//        freed by the process which created it.
+//
+// Pipes can connect threads to a pipeline with the following functions:
+//
+// struct pipeline *pipeline_create()
+//      - creates an empty pipeline.
+//
+// int pipeline_add_stage(struct pipeline *pl, void (*fn)(struct pipeline_worker *w,
+//                        void *arg), void *arg, int parallelism)
+//      - adds a stage to the end of the pipeline 'pl'. The stage is run by
+//        'parallelism' threads, each of them calls 'fn' with its worker 'w' (its
+//        index in the stage is 'w->index') and 'arg'. The stage reads what the
+//        previous stage writes.
+//      - returns index of the stage.
+//
+// void pipeline_set_capacity(struct pipeline *pl, int stage, uint capacity)
+//      - sets size of the pipe from the stage to the next one (64 KiB by default).
+//
+// void pipeline_set_batch(struct pipeline *pl, int stage, uint batch)
+//      - the stage collects writes until they have 'batch' bytes (4 KiB by
+//        default, at most the pipe size) and writes them at once. Collected
+//        writes are also written when the thread waits for its input and when
+//        the stage function returns. 0 disables batching.
+//
+// void pipeline_pin(struct pipeline *pl, int stage, int cpu)
+//      - pins threads of the stage to CPUs 'cpu', 'cpu' + 1, ...
+//
+// void pipeline_run(struct pipeline *pl)
+//      - connects the stages with pipes and starts all threads. When all threads
+//        of a stage return, the pipes to both neighbour stages are closed, so the
+//        next stage reads the rest and ends and the previous one can not write.
+//
+// void pipeline_wait(struct pipeline *pl)
+//      - waits until all threads of the pipeline 'pl' return.
+//
+// void pipeline_free(struct pipeline *pl)
+//      - frees the pipeline 'pl' after pipeline_wait.
+//
+// uint pipeline_read(struct pipeline_worker *w, unsigned char *data, uint size)
+// int pipeline_recv_msg(struct pipeline_worker *w, unsigned char *data, uint size,
+//                       uint *length)
+//      - same as pipe_read and pipe_recv_msg on the pipe from the previous stage.
+//
+// bool pipeline_write(struct pipeline_worker *w, unsigned char *data, uint size)
+// bool pipeline_send_msg(struct pipeline_worker *w, unsigned char *data, uint size)
+//      - writes data or a message to the next stage. Every write not longer than
+//        the pipe is read whole by one thread of the next stage if the readers
+//        read the same amounts.
+//      - returns false if the next stage ended.
+//
+// bool pipeline_flush(struct pipeline_worker *w)
+//      - writes collected data of the worker 'w' to the next stage now.
+//      - returns false if the next stage ended.
+//
+// Compiled with -DPIPE_BENCH, the file is a benchmark of pipes of all modes. It
+// measures throughput for plain, mirrored and elastic buffers of several sizes,
+// chunk sizes and every combination of 1, 2, 4, 8 and 16 writers and readers, and
+// round trip latency percentiles, and prints the results as CSV (see main).
 //
 
-#define _POSIX_C_SOURCE 200112L
+#define _GNU_SOURCE
 
+#include <limits.h>
+#include <stdalign.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <linux/membarrier.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 
 #define error(message) \
     printf(message);   \
@@ -59,227 +325,3486 @@
 
 typedef unsigned int uint;
 
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax()
+#endif
+
+// Sleep while '*addr' is equal to 'value', at most for 'timeout' if it is not NULL.
+// 'shared' futexes work in memory shared between processes.
+void futex_wait_timeout(
+    atomic_uint *addr, uint value, bool shared, const struct timespec *timeout)
+{
+    int op = shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE;
+    syscall(SYS_futex, addr, op, value, timeout, NULL, 0);
+}
+
+// Sleep while '*addr' is equal to 'value'
+void futex_wait(atomic_uint *addr, uint value, bool shared)
+{
+    futex_wait_timeout(addr, value, shared, NULL);
+}
+
+// Wake up all threads sleeping on 'addr'
+void futex_wake(atomic_uint *addr, bool shared)
+{
+    int op = shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE;
+    syscall(SYS_futex, addr, op, INT_MAX, NULL, NULL, 0);
+}
+
+// membarrier(2) can make all threads of this process run a full fence, it is
+// checked once before the first pipe or wait-set is created
+bool membarrier_works;
+pthread_once_t membarrier_once = PTHREAD_ONCE_INIT;
+
+void membarrier_register()
+{
+    membarrier_works =
+        syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+}
+
+// Full fence of a thread which announced that it goes to sleep and checks the
+// condition again, pairs with wake_fence. With membarrier the cost of the fence
+// is paid here, by the thread which sleeps, not by every waker. Threads of other
+// processes are not reached by membarrier, 'shared' pipes use plain fences.
+void sleep_fence(bool shared)
+{
+    if (!shared && membarrier_works)
+    {
+        syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+    }
+    else
+    {
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+}
+
+// Fence of a thread which changed the condition and checks for sleepers
+void wake_fence(bool shared)
+{
+    if (!shared && membarrier_works)
+    {
+        atomic_signal_fence(memory_order_seq_cst);
+    }
+    else
+    {
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+}
+
 #pragma region QUEUE
 
-#define Q_OK (0)
-#define Q_EMPTY (1)
-#define Q_FULL (2)
+#define CACHE_LINE_SIZE (64)
 
+// Byte ring buffer for one producer and one consumer.
+//
+// 'head' and 'tail' are free running counters, 'head - tail' is the number of
+// stored bytes and the position in 'values' is the counter modulo 'size', so the
+// whole buffer can be used. The producer publishes new bytes with a release store
+// of 'head', the consumer frees space with a release store of 'tail'. Each side
+// keeps its own copy of the other side's counter on its own cache line and reloads
+// it only when the copy says that the queue is full or empty.
+//
+// With more producers or consumers (queue_mp_write, queue_mc_read) every thread
+// first reserves its range by moving 'reserve_head' or 'reserve_tail' with
+// a compare and swap, copies its data without any lock and then waits until all
+// older reservations are finished before it moves 'head' or 'tail' behind its
+// own range. A thread whose older reservation is not finished for a long time
+// (its owner is preempted) sleeps on 'turn_seq' until something is published.
 struct queue
 {
-    uint size;
-    uint head;
-    uint tail;
-    void **values;
+    // Producer side
+    alignas(CACHE_LINE_SIZE) atomic_size_t head;
+    atomic_size_t reserve_head;
+    size_t tail_cache;
+
+    // Consumer side
+    alignas(CACHE_LINE_SIZE) atomic_size_t tail;
+    atomic_size_t reserve_tail;
+    size_t head_cache;
+
+    // Read only after creation, the queue contains no pointers so it can be placed
+    // in memory shared between processes
+    alignas(CACHE_LINE_SIZE) size_t size;
+    // The buffer starts 'values_offset' bytes after the queue itself
+    size_t values_offset;
+    // The buffer is mapped twice in a row, 'values[i + size]' is 'values[i]'
+    bool mirrored;
+    // The queue is in memory shared between processes
+    bool shared;
+
+    // Threads waiting for their turn to publish
+    alignas(CACHE_LINE_SIZE) atomic_uint turn_seq;
+    atomic_uint turn_waiters;
 };
 
-struct queue *queue_create(uint size)
+#define QUEUE_TURN_SPIN (64)
+
+void queue_init(struct queue *q, size_t size, size_t values_offset, bool mirrored, bool shared)
 {
-    struct queue *q = malloc(sizeof(struct queue));
-    q->values = malloc(sizeof(void *) * size);
     q->size = size;
-    q->head = 0;
-    q->tail = 0;
-    return q;
+    q->values_offset = values_offset;
+    q->mirrored = mirrored;
+    q->shared = shared;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->reserve_head, 0);
+    atomic_init(&q->reserve_tail, 0);
+    atomic_init(&q->turn_seq, 0);
+    atomic_init(&q->turn_waiters, 0);
+    q->tail_cache = 0;
+    q->head_cache = 0;
+}
+
+unsigned char *queue_values(struct queue *q)
+{
+    return (unsigned char *)q + q->values_offset;
 }
 
-void queue_free(struct queue *q)
+// Number of bytes which can be accessed continuously from 'offset'
+size_t queue_continuous(struct queue *q, size_t offset)
 {
-    free(q->values);
-    free(q);
+    return q->mirrored ? q->size : q->size - offset;
 }
 
-int queue_put(struct queue *q, void *value)
+// Copy 'size' bytes from 'data' to the buffer from 'offset', wraps around the end
+// of the buffer unless it is mirrored
+void queue_copy_in(struct queue *q, size_t offset, const unsigned char *data, size_t size)
 {
-    unsigned head_next = (q->head + 1) % q->size;
-    if (head_next == q->tail)
+    size_t first = queue_continuous(q, offset);
+    if (first >= size)
     {
-        return Q_FULL;
+        memcpy(queue_values(q) + offset, data, size);
+        return;
     }
 
-    q->values[q->head] = value;
-    q->head = head_next;
+    memcpy(queue_values(q) + offset, data, first);
+    memcpy(queue_values(q), data + first, size - first);
+}
+
+// Copy 'size' bytes from the buffer from 'offset' to 'data'
+void queue_copy_out(struct queue *q, size_t offset, unsigned char *data, size_t size)
+{
+    size_t first = queue_continuous(q, offset);
+    if (first >= size)
+    {
+        memcpy(data, queue_values(q) + offset, size);
+        return;
+    }
 
-    return Q_OK;
+    memcpy(data, queue_values(q) + offset, first);
+    memcpy(data + first, queue_values(q), size - first);
 }
 
-int queue_get(struct queue *q, void **result)
+// Copy up to 'size' bytes from 'data' to the queue, at most in two chunks
+// (before and after the end of the buffer, one chunk if the buffer is mirrored).
+// Must be called by the producer.
+// Returns number of bytes copied.
+size_t queue_write(struct queue *q, const unsigned char *data, size_t size)
 {
-    if (q->head == q->tail)
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t space = q->size - (head - q->tail_cache);
+    if (space < size)
+    {
+        q->tail_cache = atomic_load_explicit(&q->tail, memory_order_acquire);
+        space = q->size - (head - q->tail_cache);
+    }
+
+    if (size > space)
+    {
+        size = space;
+    }
+    if (size == 0)
     {
-        return Q_EMPTY;
+        return 0;
     }
 
-    *result = q->values[q->tail];
-    q->tail = (q->tail + 1) % q->size;
+    queue_copy_in(q, head % q->size, data, size);
 
-    return Q_OK;
+    atomic_store_explicit(&q->head, head + size, memory_order_release);
+    return size;
 }
 
-bool queue_full(struct queue *q)
+// Copy up to 'size' bytes from the queue to 'data', at most in two chunks.
+// Must be called by the consumer. Returns number of bytes copied.
+size_t queue_read(struct queue *q, unsigned char *data, size_t size)
 {
-    return ((q->head + 1) % q->size) == q->tail;
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t used = q->head_cache - tail;
+    if (used < size)
+    {
+        q->head_cache = atomic_load_explicit(&q->head, memory_order_acquire);
+        used = q->head_cache - tail;
+    }
+
+    if (size > used)
+    {
+        size = used;
+    }
+    if (size == 0)
+    {
+        return 0;
+    }
+
+    queue_copy_out(q, tail % q->size, data, size);
+
+    atomic_store_explicit(&q->tail, tail + size, memory_order_release);
+    return size;
 }
 
-bool queue_empty(struct queue *q)
+// Wait until all reservations before 'start' are published in 'counter'
+void queue_wait_turn(struct queue *q, atomic_size_t *counter, size_t start)
 {
-    return q->head == q->tail;
-}
+    for (uint i = 0; atomic_load_explicit(counter, memory_order_acquire) != start; i++)
+    {
+        if (i < QUEUE_TURN_SPIN)
+        {
+            cpu_relax();
+            continue;
+        }
 
-#pragma endregion
+        // The owner of the older reservation is probably preempted
+        uint seq = atomic_load_explicit(&q->turn_seq, memory_order_acquire);
+        atomic_fetch_add_explicit(&q->turn_waiters, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(counter, memory_order_acquire) != start)
+        {
+            futex_wait(&q->turn_seq, seq, q->shared);
+        }
+        atomic_fetch_sub_explicit(&q->turn_waiters, 1, memory_order_relaxed);
+    }
+}
 
-// Pipe struct
-typedef struct pipe
+// Do not make new reservations while some thread sleeps waiting for its turn,
+// they would only make the chain of threads waiting for each other longer
+void queue_wait_convoy(struct queue *q)
 {
-    struct queue *queue;
-    bool is_closed;
-    pthread_spinlock_t *lock;
-} pipe;
+    while (atomic_load_explicit(&q->turn_waiters, memory_order_relaxed) > 0)
+    {
+        sched_yield();
+    }
+}
 
-// Throw error if there is try to do acction NULL pipe
-void pipe_null_error(struct pipe *p, char *acction)
+// Publish the end of a finished reservation and wake up threads waiting for
+// their turn
+void queue_publish(struct queue *q, atomic_size_t *counter, size_t value)
 {
-    if (p == NULL)
+    atomic_store_explicit(counter, value, memory_order_release);
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&q->turn_waiters, memory_order_relaxed) > 0)
     {
-        errorf("Unable to %s to NULL pipe\n", acction);
+        atomic_fetch_add_explicit(&q->turn_seq, 1, memory_order_release);
+        futex_wake(&q->turn_seq, q->shared);
     }
 }
 
-// Throw error if there is try to write to NULL pipe
-void pipe_null_write_error(struct pipe *p)
+// Reserve exactly 'size' bytes for writing from '*start_out'. Can be called by more
+// producers at once. Returns false if there is not enough space.
+bool queue_mp_reserve(struct queue *q, size_t size, size_t *start_out)
 {
-    pipe_null_error(p, "write");
+    queue_wait_convoy(q);
+
+    size_t start = atomic_load_explicit(&q->reserve_head, memory_order_relaxed);
+    do
+    {
+        size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+        if (q->size - (start - tail) < size)
+        {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(
+        &q->reserve_head, &start, start + size, memory_order_relaxed, memory_order_relaxed));
+
+    *start_out = start;
+    return true;
 }
 
-// Throw error if there is try to read from NULL pipe
-void pipe_null_read_error(struct pipe *p)
+// Publish the reservation from queue_mp_reserve once its data are copied
+void queue_mp_commit(struct queue *q, size_t start, size_t size)
 {
-    pipe_null_error(p, "read");
+    queue_wait_turn(q, &q->head, start);
+    queue_publish(q, &q->head, start + size);
 }
 
-// Create and initialize pipe
-struct pipe *pipe_create(uint size)
+// Copy exactly 'size' bytes from 'data' to the queue or nothing if there is not
+// enough space. Can be called by more producers at once.
+// Returns true if the data were copied.
+bool queue_mp_write(struct queue *q, const unsigned char *data, size_t size)
 {
-    struct pipe *p = (struct pipe *)malloc(sizeof(struct pipe));
-    if (p == NULL)
+    size_t start;
+    if (!queue_mp_reserve(q, size, &start))
+    {
+        return false;
+    }
+
+    queue_copy_in(q, start % q->size, data, size);
+    queue_mp_commit(q, start, size);
+    return true;
+}
+
+// Copy up to 'size' bytes from the queue to 'data'. Can be called by more
+// consumers at once. Returns number of bytes copied.
+size_t queue_mc_read(struct queue *q, unsigned char *data, size_t size)
+{
+    queue_wait_convoy(q);
+
+    size_t start = atomic_load_explicit(&q->reserve_tail, memory_order_relaxed);
+    size_t count;
+    do
+    {
+        size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+        count = head - start;
+        if (count == 0)
+        {
+            return 0;
+        }
+        if (count > size)
+        {
+            count = size;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(
+        &q->reserve_tail, &start, start + count, memory_order_relaxed, memory_order_relaxed));
+
+    queue_copy_out(q, start % q->size, data, count);
+
+    queue_wait_turn(q, &q->tail, start);
+    queue_publish(q, &q->tail, start + count);
+    return count;
+}
+
+// Get the continuous free part of the queue if there are at least 'min' free
+// bytes. Must be called by the producer.
+// Returns length of the part or 0 if there is not enough space.
+size_t queue_write_region(struct queue *q, size_t min, unsigned char **data)
+{
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t space = q->size - (head - q->tail_cache);
+    if (space < min)
+    {
+        q->tail_cache = atomic_load_explicit(&q->tail, memory_order_acquire);
+        space = q->size - (head - q->tail_cache);
+    }
+
+    if (space < min || space == 0)
     {
-        errorf("Unable to allocate memory for new pipe of size %d\n", size);
+        return 0;
     }
 
-    struct queue *q = queue_create(size);
+    size_t offset = head % q->size;
+    size_t first = queue_continuous(q, offset);
+
+    *data = queue_values(q) + offset;
+    return space < first ? space : first;
+}
+
+// Publish 'size' bytes written to the region from queue_write_region
+void queue_write_commit(struct queue *q, size_t size)
+{
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    atomic_store_explicit(&q->head, head + size, memory_order_release);
+}
+
+// Get the continuous part of the stored data. Must be called by the consumer.
+// Returns length of the part or 0 if the queue is empty.
+size_t queue_read_region(struct queue *q, unsigned char **data)
+{
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t used = q->head_cache - tail;
+    if (used == 0)
+    {
+        q->head_cache = atomic_load_explicit(&q->head, memory_order_acquire);
+        used = q->head_cache - tail;
+    }
 
-    p->lock = (pthread_spinlock_t *)malloc(sizeof(pthread_spinlock_t));
-    if (p->lock == NULL)
+    if (used == 0)
     {
-        errorf("Unable to allocate memory for new pipe lock of size %d\n", size);
+        return 0;
     }
-    pthread_spin_init(p->lock, 0);
 
-    p->queue = q;
-    p->is_closed = false;
+    size_t offset = tail % q->size;
+    size_t first = queue_continuous(q, offset);
 
-    return p;
+    *data = queue_values(q) + offset;
+    return used < first ? used : first;
 }
 
-// Write to pipe
-uint pipe_write(struct pipe *p, unsigned char *data, uint size)
+// Free 'size' bytes read from the region from queue_read_region
+void queue_read_commit(struct queue *q, size_t size)
 {
-    pipe_null_read_error(p);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    atomic_store_explicit(&q->tail, tail + size, memory_order_release);
+}
 
-    if (p->is_closed)
+// Describe at most 'max' bytes of 'size' bytes from 'offset' by at most two
+// segments (before and after the end of the buffer). Returns number of segments.
+int queue_iov(struct queue *q, size_t offset, size_t size, size_t max, struct iovec *iov)
+{
+    if (size > max)
+    {
+        size = max;
+    }
+    if (size == 0)
     {
         return 0;
     }
 
-    // Lock the pipe for write
-    pthread_spin_lock(p->lock);
+    size_t first = queue_continuous(q, offset);
 
-    // Write to pipe
-    for (uint i = 0; i < size; i++)
+    iov[0].iov_base = queue_values(q) + offset;
+    iov[0].iov_len = size < first ? size : first;
+    if (size <= first)
     {
-        // Check if there is enough space in buffer
-        if (queue_full(p->queue))
-        {
-            // Unlock the pipe
-            pthread_spin_unlock(p->lock);
+        return 1;
+    }
 
-            // Wait for space in buffer
-            while (queue_full(p->queue))
-            {
-            }
+    iov[1].iov_base = queue_values(q);
+    iov[1].iov_len = size - first;
+    return 2;
+}
 
-            // Lock the pipe for write
-            pthread_spin_lock(p->lock);
-        }
+// Describe the free part of the queue by at most two segments. Must be called by
+// the producer, written bytes are published by queue_write_commit.
+// Returns number of segments, 0 if the queue is full.
+int queue_write_iov(struct queue *q, size_t max, struct iovec *iov)
+{
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    q->tail_cache = atomic_load_explicit(&q->tail, memory_order_acquire);
+    size_t space = q->size - (head - q->tail_cache);
+
+    return queue_iov(q, head % q->size, space, max, iov);
+}
+
+// Describe the stored data by at most two segments. Must be called by the
+// consumer, read bytes are freed by queue_read_commit.
+// Returns number of segments, 0 if the queue is empty.
+int queue_read_iov(struct queue *q, size_t max, struct iovec *iov)
+{
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    q->head_cache = atomic_load_explicit(&q->head, memory_order_acquire);
+    size_t used = q->head_cache - tail;
+
+    return queue_iov(q, tail % q->size, used, max, iov);
+}
+
+bool queue_full(struct queue *q)
+{
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    return head - tail == q->size;
+}
+
+bool queue_empty(struct queue *q)
+{
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    return head == tail;
+}
+
+// Messages are stored as their length followed by their data. Both parts are
+// published at once, so once the length is visible the whole message is.
+#define MSG_HEADER_SIZE (sizeof(uint32_t))
+
+// Length of the message stored from 'pos'
+uint32_t queue_msg_length(struct queue *q, size_t pos)
+{
+    uint32_t length;
+    queue_copy_out(q, pos % q->size, (unsigned char *)&length, MSG_HEADER_SIZE);
+    return length;
+}
 
-        unsigned char c = data[i];
-        queue_put(p->queue, (void *)c);
+// Copy message to the buffer from 'pos'
+void queue_copy_msg_in(struct queue *q, size_t pos, const unsigned char *data, uint32_t size)
+{
+    queue_copy_in(q, pos % q->size, (const unsigned char *)&size, MSG_HEADER_SIZE);
+    queue_copy_in(q, (pos + MSG_HEADER_SIZE) % q->size, data, size);
+}
 
-        // If pipe is closed, then return number of bytes written to the buffer
-        if (p->is_closed)
+// Store whole message or nothing if there is not enough space. Must be called by
+// the producer. Returns true if the message was stored.
+bool queue_put_msg(struct queue *q, const unsigned char *data, uint32_t size)
+{
+    size_t total = MSG_HEADER_SIZE + size;
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    if (q->size - (head - q->tail_cache) < total)
+    {
+        q->tail_cache = atomic_load_explicit(&q->tail, memory_order_acquire);
+        if (q->size - (head - q->tail_cache) < total)
         {
-            pthread_spin_unlock(p->lock);
-            return i;
+            return false;
         }
     }
 
-    // Unlock the pipe
-    pthread_spin_unlock(p->lock);
-    return size;
+    queue_copy_msg_in(q, head, data, size);
+    atomic_store_explicit(&q->head, head + total, memory_order_release);
+    return true;
 }
 
-// Read data from pipe
-uint pipe_read(struct pipe *p, unsigned char *data, uint size)
+// Same as queue_put_msg, but can be called by more producers at once
+bool queue_mp_put_msg(struct queue *q, const unsigned char *data, uint32_t size)
 {
-    pipe_null_read_error(p);
-
-    // If pipe is closed and there is nothing to read, then return 0
-    if (p->is_closed && queue_empty(p->queue))
+    size_t total = MSG_HEADER_SIZE + size;
+    size_t start;
+    if (!queue_mp_reserve(q, total, &start))
     {
-        return 0;
+        return false;
     }
 
-    // Lock the pipe for read
-    pthread_spin_lock(p->lock);
+    queue_copy_msg_in(q, start, data, size);
+    queue_mp_commit(q, start, total);
+    return true;
+}
 
-    // Read data from buffer
-    for (uint i = 0; i < size; i++)
+// Walk whole messages stored between 'start' and 'end' while their data fit to
+// 'size' bytes and there are less than 'count' of them. Stores their lengths to
+// 'lengths' and number of bytes they take in the buffer to 'used'.
+// Returns number of messages.
+uint queue_scan_msgs(
+    struct queue *q, size_t start, size_t end, size_t size, uint *lengths, uint count,
+    size_t *used)
+{
+    uint n = 0;
+    size_t pos = start;
+    size_t out = 0;
+    while (n < count && end - pos >= MSG_HEADER_SIZE)
     {
-        // If queue is empty, then return number of bytes read from the buffer
-        if (queue_empty(p->queue))
+        uint32_t length = queue_msg_length(q, pos);
+
+        // The length can be garbage when other consumer took the message meanwhile
+        if (end - pos - MSG_HEADER_SIZE < length || size - out < length)
         {
-            // Unlock the pipe
-            pthread_spin_unlock(p->lock);
-            return i;
+            break;
         }
 
-        void *value;
-        queue_get(p->queue, &value);
-        data[i] = (unsigned char)value;
+        lengths[n++] = length;
+        out += length;
+        pos += MSG_HEADER_SIZE + length;
     }
 
-    // Unlock the pipe
-    pthread_spin_unlock(p->lock);
-    return size;
+    *used = pos - start;
+    return n;
 }
 
-// Close pipe
-void pipe_close(struct pipe *p)
+// Copy data of 'n' messages walked by queue_scan_msgs from 'start' to 'data'
+void queue_copy_msgs_out(
+    struct queue *q, size_t start, unsigned char *data, const uint *lengths, uint n)
 {
-    pipe_null_error(p, "close");
-    p->is_closed = true;
+    for (uint i = 0; i < n; i++)
+    {
+        queue_copy_out(q, (start + MSG_HEADER_SIZE) % q->size, data, lengths[i]);
+        data += lengths[i];
+        start += MSG_HEADER_SIZE + lengths[i];
+    }
 }
 
-// Completle unallocate memory for pipe
-void pipe_free(struct pipe *p)
+// Take whole messages which fit to 'size' bytes of 'data', at most 'count' of
+// them. Must be called by the consumer. Returns number of messages.
+uint queue_get_msgs(struct queue *q, unsigned char *data, size_t size, uint *lengths, uint count)
 {
-    pipe_null_error(p, "free");
+    size_t start = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
 
-    queue_free(p->queue);
-    pthread_spin_destroy(p->lock);
-    free(p);
+    size_t used;
+    uint n = queue_scan_msgs(q, start, head, size, lengths, count, &used);
+    if (n == 0)
+    {
+        return 0;
+    }
+
+    queue_copy_msgs_out(q, start, data, lengths, n);
+    atomic_store_explicit(&q->tail, start + used, memory_order_release);
+    return n;
+}
+
+// Same as queue_get_msgs, but can be called by more consumers at once
+uint queue_mc_get_msgs(struct queue *q, unsigned char *data, size_t size, uint *lengths, uint count)
+{
+    queue_wait_convoy(q);
+
+    size_t start = atomic_load_explicit(&q->reserve_tail, memory_order_relaxed);
+    size_t used;
+    uint n;
+    do
+    {
+        size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+        n = queue_scan_msgs(q, start, head, size, lengths, count, &used);
+        if (n == 0)
+        {
+            return 0;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(
+        &q->reserve_tail, &start, start + used, memory_order_relaxed, memory_order_relaxed));
+
+    queue_copy_msgs_out(q, start, data, lengths, n);
+
+    queue_wait_turn(q, &q->tail, start);
+    queue_publish(q, &q->tail, start + used);
+    return n;
 }
 
+// Get length of the first message after the consumer counter 'tail'.
+// Returns false if there is no message.
+bool queue_peek_msg(struct queue *q, atomic_size_t *tail, uint32_t *length)
+{
+    size_t start = atomic_load_explicit(tail, memory_order_acquire);
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (head - start < MSG_HEADER_SIZE)
+    {
+        return false;
+    }
+
+    *length = queue_msg_length(q, start);
+
+    // Other consumer could take the message while its length was read
+    return atomic_load_explicit(tail, memory_order_acquire) == start;
+}
+
+#pragma endregion
+
+// Who is allowed to use the pipe
+enum pipe_mode
+{
+    // Any number of writers and readers, writers are serialized by 'write_lock'
+    // and readers by 'read_lock'
+    PIPE_MODE_LOCKED,
+    // One writer and one reader, no locks
+    PIPE_MODE_SPSC,
+    // Any number of writers and readers, no locks
+    PIPE_MODE_MPMC,
+};
+
+// How a thread waits for data or space in the pipe
+enum pipe_wait
+{
+    // Busy-wait until the pipe is ready
+    PIPE_WAIT_SPIN,
+    // Spin for a while, then sleep on a futex
+    PIPE_WAIT_FUTEX,
+    // Spin for a while, then sleep on a condition variable
+    PIPE_WAIT_CONDVAR,
+};
+
+#define PIPE_DEFAULT_SPIN (128)
+
+// Something a thread can wait for (data or space in the pipe).
+//
+// A waiter sets 'sleeping' and then checks the pipe again, a waker changes the pipe
+// and then checks 'sleeping'. Both sides put a full fence between the two steps, so
+// either the waker sees the waiter or the waiter sees the change. The waker which
+// clears 'sleeping' wakes the waiters up, the next wakers find it clear and make no
+// system call, so a reader draining a full ring does not wake the writer on every
+// read. The full fence is run by the waiter (see sleep_fence), so a thread which
+// does not wait pays only for the release store of the queue and one load.
+struct pipe_event
+{
+    // Futex word, incremented on every wake up
+    atomic_uint seq;
+    // A thread is sleeping or going to sleep and nobody woke it up yet
+    atomic_bool sleeping;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+// Events reported by pipe wait-sets
+#define PIPE_READABLE (1)
+#define PIPE_WRITABLE (2)
+#define PIPE_CLOSED (4)
+
+// Object for waiting for many pipes at once. Pipes wake up the wait-set the same
+// way as their own waiting threads (see pipe_event), the wait-set then checks all
+// its pipes.
+struct pipe_waitset
+{
+    atomic_uint seq;
+    atomic_uint waiters;
+    // Protects 'watched' and 'count'
+    pthread_mutex_t lock;
+    struct pipe_ready *watched;
+    int count;
+    int capacity;
+};
+
+// Pipe and its events, used for watched and for ready pipes
+struct pipe_ready
+{
+    struct pipe *pipe;
+    int events;
+};
+
+// One wait-set watching a pipe
+struct pipe_watch
+{
+    struct pipe_waitset *waitset;
+    struct pipe_watch *next;
+};
+
+#ifdef PIPE_STATS
+// Latency histograms have a bucket for every power of two nanoseconds, the last one
+// also counts all longer calls
+#define PIPE_STATS_BUCKETS (32)
+
+// Statistics of one direction of the pipe (writes or reads)
+struct pipe_direction_stats
+{
+    // Bytes moved and number of calls which moved some
+    uint64_t bytes;
+    uint64_t ops;
+    // Number and total duration of waits for space (writes) or data (reads)
+    uint64_t stalls;
+    uint64_t stall_ns;
+    // Iterations of spinning before the data or space came or the thread slept
+    uint64_t spins;
+    // Blocking calls, 'latency[i]' calls took between 2^i and 2^(i+1) ns
+    uint64_t latency[PIPE_STATS_BUCKETS];
+};
+
+// Snapshot of statistics of the pipe
+struct pipe_stats
+{
+    struct pipe_direction_stats write;
+    struct pipe_direction_stats read;
+    // The most bytes ever stored in the buffer
+    uint64_t high_water;
+};
+
+// Counters behind 'pipe_direction_stats', each direction is on its own cache lines
+struct pipe_counters
+{
+    alignas(CACHE_LINE_SIZE) _Atomic uint64_t bytes;
+    _Atomic uint64_t ops;
+    _Atomic uint64_t stalls;
+    _Atomic uint64_t stall_ns;
+    _Atomic uint64_t spins;
+    _Atomic uint64_t latency[PIPE_STATS_BUCKETS];
+};
+
+#define PIPE_STAT(statement) statement
+#else
+#define PIPE_STAT(statement)
+#endif
+
+#define PIPE_MAGIC (0x65706970)
+// pipe_open_shared waits at most this many milliseconds for the creator
+#define PIPE_OPEN_ATTEMPTS (1000)
+
+// State of the pipe which is seen by all its users. It contains no pointers, so
+// it can be placed in memory shared between processes. The queue is the last and
+// its buffer follows the state.
+struct pipe_state
+{
+    // PIPE_MAGIC once the state is initialized
+    atomic_uint magic;
+    // Size of the state, it differs between builds with and without PIPE_STATS
+    // which must not share a pipe. Next to the magic, so every build finds it.
+    uint state_size;
+    enum pipe_mode mode;
+    enum pipe_wait wait;
+    uint spin;
+    // Longest write which is never interleaved with other writers (MPMC only)
+    uint atomic_size;
+    atomic_bool is_closed;
+    // The state is in memory shared between processes
+    bool shared;
+    pthread_spinlock_t write_lock;
+    pthread_spinlock_t read_lock;
+    // The side is claimed by pipe_fill_from_fd or pipe_drain_to_fd, which wait in
+    // a system call without the lock (see pipe_side_claim)
+    atomic_bool write_busy;
+    atomic_bool read_busy;
+    // Signalled when data are written, readers wait on it
+    struct pipe_event readable;
+    // Signalled when data are read, writers wait on it
+    struct pipe_event writable;
+#ifdef PIPE_STATS
+    struct pipe_counters write_counters;
+    _Atomic uint64_t high_water;
+    struct pipe_counters read_counters;
+#endif
+    struct queue queue;
+};
+
+// Time after which a mostly empty elastic pipe moves to a smaller ring
+#define PIPE_ELASTIC_IDLE_NS (100000000)
+
+struct pipe_ring;
+
+// Buffer of a pipe which grows and shrinks. It is a chain of rings, the writers
+// write to the last one and when it is too small or too large they continue in a
+// new one. The readers read the rings in order and retire them, a retired ring is
+// freed when no thread can look at it (see pipe_ring_reclaim).
+struct pipe_elastic
+{
+    size_t min;
+    size_t max;
+    _Atomic(struct pipe_ring *) write_ring;
+    _Atomic(struct pipe_ring *) read_ring;
+    // Oldest ring which is not freed, rings before 'read_ring' are retired.
+    // Used only by the reader.
+    struct pipe_ring *retired;
+    // Threads looking at a ring which they do not own (see pipe_ring_enter),
+    // counted by the parity of the epoch they entered in
+    atomic_uint epoch;
+    atomic_uint users[2];
+    // Time since the ring is at most a quarter full, 0 if it is not. Used only
+    // with the write lock.
+    uint64_t low_since;
+};
+
+// Pipe struct, not typedef'd because pipe() from unistd.h owns the name. This is
+// a handle of one process, the pipe itself is in 'state'.
+struct pipe
+{
+    struct pipe_state *state;
+    // Buffer of the pipe, NULL if the pipe is elastic
+    struct queue *queue;
+    // Rings of elastic pipe, NULL if the pipe has fixed size
+    struct pipe_elastic *elastic;
+
+    // Mapping with the state, NULL if the state is allocated on the heap
+    void *mapping;
+    size_t mapping_size;
+    // Name of the shared memory object, only in the process which created it
+    char *shm_name;
+
+    // Number of wait-sets and eventfds which must be told about changes
+    atomic_uint watchers;
+    // Protects 'watches'
+    pthread_mutex_t watch_lock;
+    struct pipe_watch *watches;
+    int eventfd;
+    // The eventfd was written and not acknowledged yet
+    atomic_bool eventfd_pending;
+};
+
+// Throw error if there is try to do acction NULL pipe
+void pipe_null_error(struct pipe *p, char *acction)
+{
+    if (p == NULL)
+    {
+        errorf("Unable to %s to NULL pipe\n", acction);
+    }
+}
+
+// Throw error if there is try to write to NULL pipe
+void pipe_null_write_error(struct pipe *p)
+{
+    pipe_null_error(p, "write");
+}
+
+// Throw error if there is try to read from NULL pipe
+void pipe_null_read_error(struct pipe *p)
+{
+    pipe_null_error(p, "read");
+}
+
+bool pipe_is_closed(struct pipe *p)
+{
+    return atomic_load_explicit(&p->state->is_closed, memory_order_acquire);
+}
+
+// The sides of the pipe have locks, SPSC pipes have nothing to lock. Elastic SPSC
+// pipes lock too, readers shrink an idle pipe with the write lock (see
+// pipe_elastic_idle).
+bool pipe_is_locked(struct pipe *p)
+{
+    return p->state->mode == PIPE_MODE_LOCKED || p->elastic != NULL;
+}
+
+// Flag of the side of 'lock' which is set while the side is claimed
+atomic_bool *pipe_side_busy(struct pipe *p, pthread_spinlock_t *lock)
+{
+    return lock == &p->state->write_lock ? &p->state->write_busy : &p->state->read_busy;
+}
+
+#pragma region ELASTIC
+
+// Ring of an elastic pipe, its buffer follows it
+struct pipe_ring
+{
+    // Set when the writer moves to the next ring, nothing is written here after
+    _Atomic(struct pipe_ring *) next;
+    // Epoch in which the reader retired the ring
+    uint retired_epoch;
+    struct queue queue;
+};
+
+struct pipe_ring *pipe_ring_create(size_t size)
+{
+    struct pipe_ring *r;
+    if (posix_memalign((void **)&r, CACHE_LINE_SIZE, sizeof(struct pipe_ring) + size) != 0)
+    {
+        errorf("Unable to allocate memory for pipe buffer of size %zu\n", size);
+    }
+
+    atomic_init(&r->next, NULL);
+    r->retired_epoch = 0;
+    queue_init(&r->queue, size, sizeof(struct pipe_ring) - offsetof(struct pipe_ring, queue),
+               false, false);
+    return r;
+}
+
+// Start looking at a ring of the pipe without owning it (waiting threads and
+// statistics), the ring is not freed until pipe_ring_exit. Returns the slot for
+// pipe_ring_exit.
+uint pipe_ring_enter(struct pipe *p)
+{
+    struct pipe_elastic *e = p->elastic;
+    if (e == NULL)
+    {
+        return 0;
+    }
+
+    while (true)
+    {
+        uint epoch = atomic_load_explicit(&e->epoch, memory_order_seq_cst);
+        atomic_fetch_add_explicit(&e->users[epoch & 1], 1, memory_order_seq_cst);
+
+        // The reader did not move to the next epoch meanwhile, so it sees the thread
+        if (atomic_load_explicit(&e->epoch, memory_order_seq_cst) == epoch)
+        {
+            return epoch & 1;
+        }
+        atomic_fetch_sub_explicit(&e->users[epoch & 1], 1, memory_order_release);
+    }
+}
+
+void pipe_ring_exit(struct pipe *p, uint slot)
+{
+    if (p->elastic != NULL)
+    {
+        atomic_fetch_sub_explicit(&p->elastic->users[slot], 1, memory_order_release);
+    }
+}
+
+// Free retired rings which nobody can look at, never waits for the threads which
+// can. A ring retired in epoch E can be seen only by threads which entered in E or
+// before. The epoch moves from X to X + 1 only when no thread which entered in
+// X - 1 is left, so in epoch E + 2 the ring is unused. Must be called by the reader.
+void pipe_ring_reclaim(struct pipe_elastic *e)
+{
+    struct pipe_ring *read = atomic_load_explicit(&e->read_ring, memory_order_relaxed);
+    while (e->retired != read)
+    {
+        uint epoch = atomic_load_explicit(&e->epoch, memory_order_seq_cst);
+        if (epoch - e->retired->retired_epoch >= 2)
+        {
+            struct pipe_ring *next = atomic_load_explicit(&e->retired->next, memory_order_relaxed);
+            free(e->retired);
+            e->retired = next;
+        }
+        else if (atomic_load_explicit(&e->users[(epoch + 1) & 1], memory_order_seq_cst) == 0)
+        {
+            atomic_store_explicit(&e->epoch, epoch + 1, memory_order_seq_cst);
+        }
+        else
+        {
+            break;
+        }
+    }
+}
+
+// Queue the writers write to, must be called by the writer
+struct queue *pipe_write_queue(struct pipe *p)
+{
+    if (p->elastic == NULL)
+    {
+        return p->queue;
+    }
+    return &atomic_load_explicit(&p->elastic->write_ring, memory_order_acquire)->queue;
+}
+
+// Queue the readers read from, rings which were read to the end are retired. Must
+// be called by the reader.
+struct queue *pipe_read_queue(struct pipe *p)
+{
+    if (p->elastic == NULL)
+    {
+        return p->queue;
+    }
+
+    struct pipe_elastic *e = p->elastic;
+    struct pipe_ring *r = atomic_load_explicit(&e->read_ring, memory_order_relaxed);
+    struct pipe_ring *next;
+    while ((next = atomic_load_explicit(&r->next, memory_order_acquire)) != NULL &&
+           queue_empty(&r->queue))
+    {
+        atomic_store_explicit(&e->read_ring, next, memory_order_seq_cst);
+        r->retired_epoch = atomic_load_explicit(&e->epoch, memory_order_seq_cst);
+        r = next;
+    }
+    if (e->retired != r)
+    {
+        pipe_ring_reclaim(e);
+    }
+    return &r->queue;
+}
+
+// Move the writers to a new ring of 'size' bytes, the readers follow once they read
+// the old one. Must be called by the writer.
+void pipe_ring_switch(struct pipe *p, size_t size)
+{
+    struct pipe_elastic *e = p->elastic;
+    struct pipe_ring *old = atomic_load_explicit(&e->write_ring, memory_order_relaxed);
+    struct pipe_ring *r = pipe_ring_create(size);
+
+    atomic_store_explicit(&e->write_ring, r, memory_order_seq_cst);
+    // The reader can retire the old ring from now on
+    atomic_store_explicit(&old->next, r, memory_order_release);
+    e->low_since = 0;
+}
+
+// Move to a ring at least twice as large with space for 'size' bytes instead of
+// waiting for the readers. Must be called by the writer. Returns false if the pipe
+// has its maximum size.
+bool pipe_grow(struct pipe *p, size_t size)
+{
+    struct pipe_elastic *e = p->elastic;
+    if (e == NULL)
+    {
+        return false;
+    }
+
+    size_t current = pipe_write_queue(p)->size;
+    if (current >= e->max)
+    {
+        return false;
+    }
+
+    size_t grown = 2 * current;
+    while (grown < size && grown < e->max)
+    {
+        grown *= 2;
+    }
+    pipe_ring_switch(p, grown < e->max ? grown : e->max);
+    return true;
+}
+
+uint64_t pipe_elastic_clock()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Move to a ring half as large when the ring is at most a quarter full for
+// PIPE_ELASTIC_IDLE_NS. Must be called with the write lock.
+void pipe_shrink_idle(struct pipe *p)
+{
+    struct pipe_elastic *e = p->elastic;
+    if (e == NULL)
+    {
+        return;
+    }
+
+    struct queue *q = pipe_write_queue(p);
+    if (q->size <= e->min)
+    {
+        return;
+    }
+
+    size_t used = atomic_load_explicit(&q->head, memory_order_relaxed) -
+                  atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (used > q->size / 4)
+    {
+        e->low_since = 0;
+        return;
+    }
+
+    uint64_t now = pipe_elastic_clock();
+    if (e->low_since == 0)
+    {
+        e->low_since = now;
+    }
+    else if (now - e->low_since >= PIPE_ELASTIC_IDLE_NS)
+    {
+        pipe_ring_switch(p, q->size / 2 > e->min ? q->size / 2 : e->min);
+        // The next halving follows after the same time
+        e->low_since = now;
+    }
+}
+
+// Shrink an elastic pipe and free its retired rings when no writer or reader uses
+// it. Called by readers which found the pipe empty, also while they wait, so an
+// idle pipe gives its memory back. The locks are only tried, nobody is waited for.
+void pipe_elastic_idle(struct pipe *p)
+{
+    if (p->elastic == NULL)
+    {
+        return;
+    }
+
+    // A claimed side is in a system call with the ring, it must not move
+    if (pthread_spin_trylock(&p->state->write_lock) == 0)
+    {
+        if (!atomic_load_explicit(&p->state->write_busy, memory_order_acquire))
+        {
+            pipe_shrink_idle(p);
+        }
+        pthread_spin_unlock(&p->state->write_lock);
+    }
+    if (pthread_spin_trylock(&p->state->read_lock) == 0)
+    {
+        if (!atomic_load_explicit(&p->state->read_busy, memory_order_acquire))
+        {
+            pipe_read_queue(p);
+        }
+        pthread_spin_unlock(&p->state->read_lock);
+    }
+}
+
+// Most bytes the pipe can hold
+size_t pipe_capacity(struct pipe *p)
+{
+    return p->elastic != NULL ? p->elastic->max : p->queue->size;
+}
+
+#pragma endregion
+
+#ifdef PIPE_STATS
+#pragma region STATS
+
+// Monotonic time in nanoseconds
+uint64_t pipe_stats_clock()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void pipe_stats_add(_Atomic uint64_t *counter, uint64_t value)
+{
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+// Count 'bytes' moved by one call, if 'start' is not 0, the call is blocking and
+// it started at 'start'
+void pipe_stats_transfer(struct pipe_counters *c, size_t bytes, uint64_t start)
+{
+    if (bytes > 0)
+    {
+        pipe_stats_add(&c->bytes, bytes);
+        pipe_stats_add(&c->ops, 1);
+    }
+
+    if (start != 0)
+    {
+        uint64_t ns = pipe_stats_clock() - start;
+        int bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+        if (bucket >= PIPE_STATS_BUCKETS)
+        {
+            bucket = PIPE_STATS_BUCKETS - 1;
+        }
+        pipe_stats_add(&c->latency[bucket], 1);
+    }
+}
+
+void pipe_stats_write(struct pipe *p, size_t bytes, uint64_t start)
+{
+    pipe_stats_transfer(&p->state->write_counters, bytes, start);
+
+    // Raise the high-water mark, its cache line is written only when it grows
+    uint slot = pipe_ring_enter(p);
+    struct queue *q = pipe_write_queue(p);
+    uint64_t used = atomic_load_explicit(&q->head, memory_order_relaxed) -
+                    atomic_load_explicit(&q->tail, memory_order_relaxed);
+    uint64_t high = atomic_load_explicit(&p->state->high_water, memory_order_relaxed);
+    while (used > high && used <= q->size &&
+           !atomic_compare_exchange_weak_explicit(
+               &p->state->high_water, &high, used, memory_order_relaxed, memory_order_relaxed))
+    {
+    }
+    pipe_ring_exit(p, slot);
+}
+
+void pipe_stats_read(struct pipe *p, size_t bytes, uint64_t start)
+{
+    pipe_stats_transfer(&p->state->read_counters, bytes, start);
+}
+
+// Total length of 'count' messages
+uint64_t pipe_stats_sum(const uint *lengths, uint count)
+{
+    uint64_t sum = 0;
+    for (uint i = 0; i < count; i++)
+    {
+        sum += lengths[i];
+    }
+    return sum;
+}
+
+// Count a wait which started at 'start' and spun 'spins' times
+void pipe_stats_stall(struct pipe_counters *c, uint spins, uint64_t start)
+{
+    pipe_stats_add(&c->stalls, 1);
+    pipe_stats_add(&c->stall_ns, pipe_stats_clock() - start);
+    pipe_stats_add(&c->spins, spins);
+}
+
+void pipe_stats_snapshot(struct pipe_counters *c, struct pipe_direction_stats *stats)
+{
+    stats->bytes = atomic_load_explicit(&c->bytes, memory_order_relaxed);
+    stats->ops = atomic_load_explicit(&c->ops, memory_order_relaxed);
+    stats->stalls = atomic_load_explicit(&c->stalls, memory_order_relaxed);
+    stats->stall_ns = atomic_load_explicit(&c->stall_ns, memory_order_relaxed);
+    stats->spins = atomic_load_explicit(&c->spins, memory_order_relaxed);
+    for (int i = 0; i < PIPE_STATS_BUCKETS; i++)
+    {
+        stats->latency[i] = atomic_load_explicit(&c->latency[i], memory_order_relaxed);
+    }
+}
+
+void pipe_stats_clear(struct pipe_counters *c)
+{
+    atomic_store_explicit(&c->bytes, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->ops, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->stalls, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->stall_ns, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->spins, 0, memory_order_relaxed);
+    for (int i = 0; i < PIPE_STATS_BUCKETS; i++)
+    {
+        atomic_store_explicit(&c->latency[i], 0, memory_order_relaxed);
+    }
+}
+
+#pragma endregion
+#endif
+
+#pragma region WAIT
+
+void pipe_event_init(struct pipe_event *ev, bool shared)
+{
+    int pshared = shared ? PTHREAD_PROCESS_SHARED : PTHREAD_PROCESS_PRIVATE;
+
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, pshared);
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, pshared);
+
+    atomic_init(&ev->seq, 0);
+    atomic_init(&ev->sleeping, false);
+    pthread_mutex_init(&ev->mutex, &mutex_attr);
+    pthread_cond_init(&ev->cond, &cond_attr);
+
+    pthread_mutexattr_destroy(&mutex_attr);
+    pthread_condattr_destroy(&cond_attr);
+}
+
+void pipe_event_destroy(struct pipe_event *ev)
+{
+    pthread_mutex_destroy(&ev->mutex);
+    pthread_cond_destroy(&ev->cond);
+}
+
+// Wake up the thread waiting in the wait-set
+void pipe_waitset_wake(struct pipe_waitset *ws)
+{
+    if (atomic_load_explicit(&ws->waiters, memory_order_relaxed) > 0)
+    {
+        atomic_fetch_add_explicit(&ws->seq, 1, memory_order_release);
+        futex_wake(&ws->seq, false);
+    }
+}
+
+// Tell wait-sets and the eventfd watching the pipe that the event happened
+void pipe_notify_watchers(struct pipe *p, struct pipe_event *ev)
+{
+    pthread_mutex_lock(&p->watch_lock);
+    for (struct pipe_watch *w = p->watches; w != NULL; w = w->next)
+    {
+        pipe_waitset_wake(w->waitset);
+    }
+    pthread_mutex_unlock(&p->watch_lock);
+
+    // The eventfd reports only new data and close
+    if (p->eventfd != -1 && (ev == &p->state->readable || pipe_is_closed(p)) &&
+        !atomic_exchange_explicit(&p->eventfd_pending, true, memory_order_acq_rel))
+    {
+        eventfd_write(p->eventfd, 1);
+    }
+}
+
+// Wake up all threads waiting for the event
+void pipe_event_signal(struct pipe *p, struct pipe_event *ev)
+{
+    wake_fence(p->state->shared);
+    if (atomic_load_explicit(&p->watchers, memory_order_relaxed) > 0)
+    {
+        pipe_notify_watchers(p, ev);
+    }
+
+    if (p->state->wait == PIPE_WAIT_SPIN ||
+        !atomic_load_explicit(&ev->sleeping, memory_order_relaxed) ||
+        !atomic_exchange_explicit(&ev->sleeping, false, memory_order_relaxed))
+    {
+        return;
+    }
+
+    if (p->state->wait == PIPE_WAIT_FUTEX)
+    {
+        atomic_fetch_add_explicit(&ev->seq, 1, memory_order_release);
+        futex_wake(&ev->seq, p->state->shared);
+    }
+    else
+    {
+        pthread_mutex_lock(&ev->mutex);
+        pthread_cond_broadcast(&ev->cond);
+        pthread_mutex_unlock(&ev->mutex);
+    }
+}
+
+// Wait until 'ready' returns true for 'size' bytes, returns number of spins before
+uint pipe_event_block(
+    struct pipe *p, struct pipe_event *ev, bool (*ready)(struct pipe *, size_t), size_t size)
+{
+    for (uint i = 0; p->state->wait == PIPE_WAIT_SPIN || i < p->state->spin; i++)
+    {
+        if (ready(p, size))
+        {
+            return i;
+        }
+        cpu_relax();
+    }
+
+    // Readers of an elastic pipe wake up now and then to shrink it while it is idle
+    bool idle = p->elastic != NULL && ev == &p->state->readable;
+    struct timespec period = {0, PIPE_ELASTIC_IDLE_NS};
+
+    if (p->state->wait == PIPE_WAIT_FUTEX)
+    {
+        while (true)
+        {
+            uint seq = atomic_load_explicit(&ev->seq, memory_order_acquire);
+            atomic_store_explicit(&ev->sleeping, true, memory_order_relaxed);
+            sleep_fence(p->state->shared);
+
+            if (ready(p, size))
+            {
+                return p->state->spin;
+            }
+            futex_wait_timeout(&ev->seq, seq, p->state->shared, idle ? &period : NULL);
+            if (idle)
+            {
+                pipe_elastic_idle(p);
+            }
+        }
+    }
+
+    // The waker clears 'sleeping' before it takes the mutex, which is held from
+    // the check until the wait, so the broadcast can not come in between
+    pthread_mutex_lock(&ev->mutex);
+    while (true)
+    {
+        atomic_store_explicit(&ev->sleeping, true, memory_order_relaxed);
+        sleep_fence(p->state->shared);
+
+        if (ready(p, size))
+        {
+            break;
+        }
+        if (!idle)
+        {
+            pthread_cond_wait(&ev->cond, &ev->mutex);
+            continue;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += period.tv_nsec;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&ev->cond, &ev->mutex, &deadline);
+        pipe_elastic_idle(p);
+    }
+    pthread_mutex_unlock(&ev->mutex);
+    return p->state->spin;
+}
+
+// Wait until 'ready' returns true for 'size' bytes
+void pipe_event_wait(
+    struct pipe *p, struct pipe_event *ev, bool (*ready)(struct pipe *, size_t), size_t size)
+{
+#ifdef PIPE_STATS
+    uint64_t start = pipe_stats_clock();
+    uint spins = pipe_event_block(p, ev, ready, size);
+    pipe_stats_stall(
+        ev == &p->state->writable ? &p->state->write_counters : &p->state->read_counters,
+        spins, start);
+#else
+    pipe_event_block(p, ev, ready, size);
+#endif
+}
+
+// There is space for 'size' bytes in the pipe
+bool pipe_can_write(struct pipe *p, size_t size)
+{
+    if (p->elastic != NULL)
+    {
+        // The writers move to a larger ring instead of waiting
+        uint slot = pipe_ring_enter(p);
+        struct queue *q = pipe_write_queue(p);
+        size_t used = atomic_load_explicit(&q->head, memory_order_acquire) -
+                      atomic_load_explicit(&q->tail, memory_order_acquire);
+        bool ready = q->size < p->elastic->max || q->size - used >= size;
+        pipe_ring_exit(p, slot);
+        return ready;
+    }
+
+    struct queue *q = p->queue;
+    atomic_size_t *head = p->state->mode == PIPE_MODE_MPMC ? &q->reserve_head : &q->head;
+    size_t used = atomic_load_explicit(head, memory_order_acquire) -
+                  atomic_load_explicit(&q->tail, memory_order_acquire);
+    return q->size - used >= size;
+}
+
+// There are at least 'size' bytes in the pipe
+bool pipe_can_read(struct pipe *p, size_t size)
+{
+    if (p->elastic != NULL)
+    {
+        // Rest of the data is in the next ring
+        uint slot = pipe_ring_enter(p);
+        struct pipe_ring *r = atomic_load_explicit(&p->elastic->read_ring, memory_order_seq_cst);
+        size_t used = atomic_load_explicit(&r->queue.head, memory_order_acquire) -
+                      atomic_load_explicit(&r->queue.tail, memory_order_acquire);
+        bool ready = used >= size || atomic_load_explicit(&r->next, memory_order_acquire) != NULL;
+        pipe_ring_exit(p, slot);
+        return ready;
+    }
+
+    struct queue *q = p->queue;
+    atomic_size_t *tail = p->state->mode == PIPE_MODE_MPMC ? &q->reserve_tail : &q->tail;
+    size_t used = atomic_load_explicit(&q->head, memory_order_acquire) -
+                  atomic_load_explicit(tail, memory_order_acquire);
+    return used >= size;
+}
+
+// Writers wait for it, there is space for 'size' bytes or the pipe is closed
+bool pipe_writable(struct pipe *p, size_t size)
+{
+    return pipe_can_write(p, size) || pipe_is_closed(p);
+}
+
+// Readers wait for it, there are 'size' bytes or the pipe is closed
+bool pipe_readable(struct pipe *p, size_t size)
+{
+    return pipe_can_read(p, size) || pipe_is_closed(p);
+}
+
+bool pipe_write_side_free(struct pipe *p, size_t size)
+{
+    (void)size;
+    return !atomic_load_explicit(&p->state->write_busy, memory_order_acquire);
+}
+
+bool pipe_read_side_free(struct pipe *p, size_t size)
+{
+    (void)size;
+    return !atomic_load_explicit(&p->state->read_busy, memory_order_acquire);
+}
+
+// Take the lock of one side of the pipe. While the side is claimed, the thread
+// sleeps like a thread waiting for space or data, even if the pipe is closed.
+void pipe_lock(struct pipe *p, pthread_spinlock_t *lock)
+{
+    if (!pipe_is_locked(p))
+    {
+        return;
+    }
+
+    pthread_spin_lock(lock);
+    bool write = lock == &p->state->write_lock;
+    while (atomic_load_explicit(pipe_side_busy(p, lock), memory_order_acquire))
+    {
+        pthread_spin_unlock(lock);
+        pipe_event_wait(p, write ? &p->state->writable : &p->state->readable,
+                        write ? pipe_write_side_free : pipe_read_side_free, 0);
+        pthread_spin_lock(lock);
+    }
+}
+
+// Take the lock of one side of the pipe if it is not claimed, never sleeps
+bool pipe_try_lock(struct pipe *p, pthread_spinlock_t *lock)
+{
+    if (!pipe_is_locked(p))
+    {
+        return true;
+    }
+
+    pthread_spin_lock(lock);
+    if (atomic_load_explicit(pipe_side_busy(p, lock), memory_order_acquire))
+    {
+        pthread_spin_unlock(lock);
+        return false;
+    }
+    return true;
+}
+
+void pipe_unlock(struct pipe *p, pthread_spinlock_t *lock)
+{
+    if (pipe_is_locked(p))
+    {
+        pthread_spin_unlock(lock);
+    }
+}
+
+// Keep the side of 'lock' for the caller but release its spinlock, for a system
+// call which can block. Others taking the lock sleep until pipe_side_release
+// instead of spinning. Must be called with the lock.
+void pipe_side_claim(struct pipe *p, pthread_spinlock_t *lock)
+{
+    if (pipe_is_locked(p))
+    {
+        atomic_store_explicit(pipe_side_busy(p, lock), true, memory_order_relaxed);
+        pthread_spin_unlock(lock);
+    }
+}
+
+// Take the lock back after pipe_side_claim and wake up the threads waiting for it
+void pipe_side_release(struct pipe *p, pthread_spinlock_t *lock)
+{
+    if (pipe_is_locked(p))
+    {
+        pthread_spin_lock(lock);
+        atomic_store_explicit(pipe_side_busy(p, lock), false, memory_order_release);
+        pipe_event_signal(
+            p, lock == &p->state->write_lock ? &p->state->writable : &p->state->readable);
+    }
+}
+
+#pragma endregion
+
+// Size of the pipe state in a mapping, the buffer starts on the next page
+size_t pipe_header_size(void)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (sizeof(struct pipe_state) + page - 1) / page * page;
+}
+
+// Buffer size of a mapped pipe, rounded up to the page size
+size_t pipe_mapped_size(uint size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (size + page - 1) / page * page;
+}
+
+// Map 'header' bytes of the pipe state and 'length' bytes of the buffer from 'fd'.
+// A mirrored buffer is mapped once more right after itself.
+unsigned char *pipe_map(int fd, size_t header, size_t length, bool mirrored)
+{
+    // Reserve address space for everything, then map the fd over it
+    size_t total = header + length + (mirrored ? length : 0);
+    unsigned char *base = mmap(NULL, total, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    if (mmap(base, header + length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) ==
+            MAP_FAILED ||
+        (mirrored && mmap(base + header + length, length, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_FIXED, fd, header) == MAP_FAILED))
+    {
+        munmap(base, total);
+        return NULL;
+    }
+
+    return base;
+}
+
+// Initialize pipe state whose buffer of 'size' bytes starts 'header' bytes after it
+void pipe_state_init(
+    struct pipe_state *s, size_t size, size_t header, enum pipe_mode mode, bool mirrored,
+    bool shared)
+{
+    int pshared = shared ? PTHREAD_PROCESS_SHARED : PTHREAD_PROCESS_PRIVATE;
+    pthread_spin_init(&s->write_lock, pshared);
+    pthread_spin_init(&s->read_lock, pshared);
+
+    pipe_event_init(&s->readable, shared);
+    pipe_event_init(&s->writable, shared);
+
+    queue_init(&s->queue, size, header - offsetof(struct pipe_state, queue), mirrored, shared);
+
+    s->mode = mode;
+    s->wait = PIPE_WAIT_FUTEX;
+    s->spin = PIPE_DEFAULT_SPIN;
+    s->atomic_size = size;
+    s->shared = shared;
+    atomic_init(&s->is_closed, false);
+    atomic_init(&s->write_busy, false);
+    atomic_init(&s->read_busy, false);
+#ifdef PIPE_STATS
+    pipe_stats_clear(&s->write_counters);
+    pipe_stats_clear(&s->read_counters);
+    atomic_init(&s->high_water, 0);
+#endif
+    s->state_size = sizeof(struct pipe_state);
+    atomic_store_explicit(&s->magic, PIPE_MAGIC, memory_order_release);
+}
+
+// Allocate handle of the pipe with state 's'
+struct pipe *pipe_handle_create(struct pipe_state *s, void *mapping, size_t mapping_size)
+{
+    struct pipe *p = (struct pipe *)malloc(sizeof(struct pipe));
+    if (p == NULL)
+    {
+        error("Unable to allocate memory for new pipe\n");
+    }
+
+    pthread_once(&membarrier_once, membarrier_register);
+
+    p->state = s;
+    p->queue = &s->queue;
+    p->elastic = NULL;
+    p->mapping = mapping;
+    p->mapping_size = mapping_size;
+    p->shm_name = NULL;
+
+    atomic_init(&p->watchers, 0);
+    pthread_mutex_init(&p->watch_lock, NULL);
+    p->watches = NULL;
+    p->eventfd = -1;
+    atomic_init(&p->eventfd_pending, false);
+
+    return p;
+}
+
+// Create and initialize pipe in the given mode
+struct pipe *pipe_create_mode(uint size, enum pipe_mode mode, bool mirrored)
+{
+    if (size == 0)
+    {
+        error("Unable to create pipe of size 0\n");
+    }
+
+    if (!mirrored)
+    {
+        struct pipe_state *s;
+        if (posix_memalign((void **)&s, CACHE_LINE_SIZE, sizeof(struct pipe_state) + size) != 0)
+        {
+            errorf("Unable to allocate memory for new pipe buffer of size %d\n", size);
+        }
+
+        pipe_state_init(s, size, sizeof(struct pipe_state), mode, false, false);
+        return pipe_handle_create(s, NULL, 0);
+    }
+
+    size_t header = pipe_header_size();
+    size_t length = pipe_mapped_size(size);
+
+    unsigned char *mapping = NULL;
+    int fd = memfd_create("pipe", MFD_CLOEXEC);
+    if (fd != -1 && ftruncate(fd, header + length) == 0)
+    {
+        mapping = pipe_map(fd, header, length, true);
+    }
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    if (mapping == NULL)
+    {
+        errorf("Unable to map memory for new pipe buffer of size %d\n", size);
+    }
+
+    struct pipe_state *s = (struct pipe_state *)mapping;
+    pipe_state_init(s, length, header, mode, true, false);
+    return pipe_handle_create(s, mapping, header + 2 * length);
+}
+
+// Create and initialize pipe
+struct pipe *pipe_create(uint size)
+{
+    return pipe_create_mode(size, PIPE_MODE_LOCKED, false);
+}
+
+// Create and initialize pipe for one writer and one reader
+struct pipe *pipe_create_spsc(uint size)
+{
+    return pipe_create_mode(size, PIPE_MODE_SPSC, false);
+}
+
+// Create and initialize pipe for any number of writers and readers without locks
+struct pipe *pipe_create_mpmc(uint size, uint atomic_size)
+{
+    if (atomic_size == 0 || atomic_size > size)
+    {
+        errorf("Atomic size %d must be between 1 and pipe size %d\n", atomic_size, size);
+    }
+
+    struct pipe *p = pipe_create_mode(size, PIPE_MODE_MPMC, false);
+    p->state->atomic_size = atomic_size;
+    return p;
+}
+
+// Create and initialize pipe with the buffer mapped twice in a row
+struct pipe *pipe_create_mirrored(uint size, enum pipe_mode mode)
+{
+    return pipe_create_mode(size, mode, true);
+}
+
+// Create pipe whose buffer has 'min' bytes and grows up to 'max' bytes when the
+// writers would wait
+struct pipe *pipe_create_elastic(uint min, uint max, enum pipe_mode mode)
+{
+    if (min == 0 || min > max)
+    {
+        errorf("Unable to create elastic pipe of size %d to %d\n", min, max);
+    }
+    if (mode == PIPE_MODE_MPMC)
+    {
+        error("Unable to create elastic MPMC pipe\n");
+    }
+
+    // The buffer is in the rings, the queue of the state is not used
+    struct pipe_state *s;
+    if (posix_memalign((void **)&s, CACHE_LINE_SIZE, sizeof(struct pipe_state)) != 0)
+    {
+        error("Unable to allocate memory for new pipe\n");
+    }
+    pipe_state_init(s, 0, sizeof(struct pipe_state), mode, false, false);
+
+    struct pipe_elastic *e = malloc(sizeof(struct pipe_elastic));
+    if (e == NULL)
+    {
+        error("Unable to allocate memory for new pipe\n");
+    }
+    struct pipe_ring *r = pipe_ring_create(min);
+    e->min = min;
+    e->max = max;
+    atomic_init(&e->write_ring, r);
+    atomic_init(&e->read_ring, r);
+    e->retired = r;
+    atomic_init(&e->epoch, 0);
+    atomic_init(&e->users[0], 0);
+    atomic_init(&e->users[1], 0);
+    e->low_since = 0;
+
+    struct pipe *p = pipe_handle_create(s, NULL, 0);
+    p->queue = NULL;
+    p->elastic = e;
+    return p;
+}
+
+// Create pipe in the given mode in shared memory object 'name', so other processes
+// can open it with pipe_open_shared
+struct pipe *pipe_create_shared_mode(
+    const char *name, uint size, enum pipe_mode mode, bool mirrored)
+{
+    if (size == 0)
+    {
+        error("Unable to create pipe of size 0\n");
+    }
+
+    size_t header = pipe_header_size();
+    size_t length = pipe_mapped_size(size);
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1)
+    {
+        errorf("Unable to create shared memory object %s\n", name);
+    }
+
+    unsigned char *mapping = NULL;
+    if (ftruncate(fd, header + length) == 0)
+    {
+        mapping = pipe_map(fd, header, length, mirrored);
+    }
+    close(fd);
+    if (mapping == NULL)
+    {
+        shm_unlink(name);
+        errorf("Unable to map shared memory object %s of size %d\n", name, size);
+    }
+
+    struct pipe_state *s = (struct pipe_state *)mapping;
+    pipe_state_init(s, length, header, mode, mirrored, true);
+
+    struct pipe *p = pipe_handle_create(s, mapping, header + (mirrored ? 2 : 1) * length);
+    p->shm_name = strdup(name);
+    if (p->shm_name == NULL)
+    {
+        error("Unable to allocate memory for name of shared pipe\n");
+    }
+    return p;
+}
+
+// Create pipe in shared memory object 'name', so other processes can open it
+struct pipe *pipe_create_shared(const char *name, uint size)
+{
+    return pipe_create_shared_mode(name, size, PIPE_MODE_LOCKED, false);
+}
+
+// Open pipe created by pipe_create_shared in other process, waits until the other
+// process creates and initializes it
+struct pipe *pipe_open_shared(const char *name)
+{
+    // The creator creates the object, sets its size and then initializes the
+    // state, map only the state until it is ready
+    size_t header = pipe_header_size();
+    int fd = -1;
+    struct pipe_state *s = MAP_FAILED;
+    for (int attempt = 0; attempt < PIPE_OPEN_ATTEMPTS; attempt++)
+    {
+        if (fd == -1)
+        {
+            fd = shm_open(name, O_RDWR, 0);
+            if (fd == -1 && errno != ENOENT)
+            {
+                break;
+            }
+        }
+
+        struct stat st;
+        if (fd != -1 && s == MAP_FAILED && fstat(fd, &st) == 0 &&
+            (size_t)st.st_size >= header)
+        {
+            s = mmap(NULL, header, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        if (s != MAP_FAILED &&
+            atomic_load_explicit(&s->magic, memory_order_acquire) == PIPE_MAGIC)
+        {
+            break;
+        }
+        nanosleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+    }
+    if (fd == -1)
+    {
+        errorf("Unable to open shared memory object %s\n", name);
+    }
+    if (s == MAP_FAILED || atomic_load_explicit(&s->magic, memory_order_acquire) != PIPE_MAGIC)
+    {
+        errorf("Shared memory object %s is not a pipe\n", name);
+    }
+    if (s->state_size != sizeof(struct pipe_state))
+    {
+        errorf("Shared memory object %s is a pipe of a build with other state layout\n",
+               name);
+    }
+
+    size_t length = s->queue.size;
+    bool mirrored = s->queue.mirrored;
+    munmap(s, header);
+
+    unsigned char *mapping = pipe_map(fd, header, length, mirrored);
+    close(fd);
+    if (mapping == NULL)
+    {
+        errorf("Unable to map shared memory object %s\n", name);
+    }
+
+    return pipe_handle_create(
+        (struct pipe_state *)mapping, mapping, header + (mirrored ? 2 : 1) * length);
+}
+
+// Size of the next piece written by pipe_write, MPMC pipes write whole pieces
+size_t pipe_write_piece(struct pipe *p, size_t size)
+{
+    if (p->state->mode != PIPE_MODE_MPMC)
+    {
+        return 1;
+    }
+    return size < p->state->atomic_size ? size : p->state->atomic_size;
+}
+
+// Copy as much as possible of 'data' to the queue of the pipe
+size_t pipe_queue_write(struct pipe *p, const unsigned char *data, size_t size)
+{
+    if (p->state->mode != PIPE_MODE_MPMC)
+    {
+        return queue_write(pipe_write_queue(p), data, size);
+    }
+
+    size_t piece = pipe_write_piece(p, size);
+    return queue_mp_write(p->queue, data, piece) ? piece : 0;
+}
+
+// Copy as much as possible from the queue of the pipe to 'data'
+size_t pipe_queue_read(struct pipe *p, unsigned char *data, size_t size)
+{
+    if (p->state->mode != PIPE_MODE_MPMC)
+    {
+        return queue_read(pipe_read_queue(p), data, size);
+    }
+    return queue_mc_read(p->queue, data, size);
+}
+
+// Set how blocked threads wait, must be called before the pipe is used
+void pipe_set_wait(struct pipe *p, enum pipe_wait wait, uint spin)
+{
+    pipe_null_error(p, "configure");
+    p->state->wait = wait;
+    p->state->spin = spin;
+}
+
+// Write to pipe
+uint pipe_write(struct pipe *p, unsigned char *data, uint size)
+{
+    pipe_null_write_error(p);
+
+    if (pipe_is_closed(p))
+    {
+        return 0;
+    }
+
+    PIPE_STAT(uint64_t start = pipe_stats_clock());
+
+    // Lock the pipe for write
+    pipe_lock(p, &p->state->write_lock);
+
+    // Write to pipe, if pipe is closed, then return number of bytes written to
+    // the buffer
+    uint written = 0;
+    while (written < size && !pipe_is_closed(p))
+    {
+        size_t n = pipe_queue_write(p, data + written, size - written);
+        if (n > 0)
+        {
+            written += n;
+            pipe_shrink_idle(p);
+            pipe_event_signal(p, &p->state->readable);
+            continue;
+        }
+
+        // Elastic pipe grows instead of waiting
+        if (pipe_grow(p, pipe_write_piece(p, size - written)))
+        {
+            continue;
+        }
+
+        // Unlock the pipe
+        pipe_unlock(p, &p->state->write_lock);
+
+        // Wait for space in buffer
+        pipe_event_wait(p, &p->state->writable, pipe_writable, pipe_write_piece(p, size - written));
+
+        // Lock the pipe for write
+        pipe_lock(p, &p->state->write_lock);
+    }
+
+    // Unlock the pipe
+    pipe_unlock(p, &p->state->write_lock);
+    PIPE_STAT(pipe_stats_write(p, written, start));
+    return written;
+}
+
+// Read data from pipe
+uint pipe_read(struct pipe *p, unsigned char *data, uint size)
+{
+    pipe_null_read_error(p);
+
+    // If pipe is closed and there is nothing to read, then return 0
+    if (pipe_is_closed(p) && !pipe_can_read(p, 1))
+    {
+        return 0;
+    }
+
+    PIPE_STAT(uint64_t start = pipe_stats_clock());
+
+    // Lock the pipe for read
+    pipe_lock(p, &p->state->read_lock);
+
+    // Read data from buffer
+    uint read = 0;
+    while (read < size)
+    {
+        // Data written before close are visible once the close is seen
+        bool is_closed = pipe_is_closed(p);
+
+        size_t n = pipe_queue_read(p, data + read, size - read);
+        if (n > 0)
+        {
+            read += n;
+            pipe_event_signal(p, &p->state->writable);
+            continue;
+        }
+
+        // If pipe is closed and empty, then return number of bytes read
+        if (is_closed)
+        {
+            break;
+        }
+
+        // Unlock the pipe
+        pipe_unlock(p, &p->state->read_lock);
+
+        // Wait for data in buffer
+        pipe_event_wait(p, &p->state->readable, pipe_readable, 1);
+
+        // Lock the pipe for read
+        pipe_lock(p, &p->state->read_lock);
+    }
+
+    // Unlock the pipe
+    pipe_unlock(p, &p->state->read_lock);
+    PIPE_STAT(pipe_stats_read(p, read, start));
+    return read;
+}
+
+// Throw error if zero-copy functions are used on MPMC pipe
+void pipe_zero_copy_error(struct pipe *p)
+{
+    if (p->state->mode == PIPE_MODE_MPMC)
+    {
+        error("Unable to access buffer of MPMC pipe directly\n");
+    }
+}
+
+// Wait for at least 'min' free bytes and get continuous free part of the buffer
+bool pipe_write_reserve(struct pipe *p, uint min, unsigned char **data, uint *size)
+{
+    pipe_null_write_error(p);
+    pipe_zero_copy_error(p);
+
+    if (min > pipe_capacity(p))
+    {
+        errorf("Unable to reserve %d bytes in pipe of size %zu\n", min, pipe_capacity(p));
+    }
+    if (min == 0)
+    {
+        min = 1;
+    }
+
+    PIPE_STAT(uint64_t start = pipe_stats_clock());
+
+    // Lock the pipe for write, it is unlocked in pipe_write_commit
+    pipe_lock(p, &p->state->write_lock);
+
+    while (!pipe_is_closed(p))
+    {
+        size_t n = queue_write_region(pipe_write_queue(p), min, data);
+        if (n > 0)
+        {
+            *size = n;
+            PIPE_STAT(pipe_stats_write(p, 0, start));
+            return true;
+        }
+        if (pipe_grow(p, min))
+        {
+            continue;
+        }
+
+        // Wait for space in buffer
+        pipe_unlock(p, &p->state->write_lock);
+        pipe_event_wait(p, &p->state->writable, pipe_writable, min);
+        pipe_lock(p, &p->state->write_lock);
+    }
+
+    pipe_unlock(p, &p->state->write_lock);
+    PIPE_STAT(pipe_stats_write(p, 0, start));
+    return false;
+}
+
+// Make 'size' bytes written to the reserved part readable
+void pipe_write_commit(struct pipe *p, uint size)
+{
+    pipe_null_write_error(p);
+
+    if (size > 0)
+    {
+        queue_write_commit(pipe_write_queue(p), size);
+        pipe_shrink_idle(p);
+        pipe_event_signal(p, &p->state->readable);
+        PIPE_STAT(pipe_stats_write(p, size, 0));
+    }
+
+    pipe_unlock(p, &p->state->write_lock);
+}
+
+// Wait for data and get continuous part of them
+bool pipe_read_peek(struct pipe *p, unsigned char **data, uint *size)
+{
+    pipe_null_read_error(p);
+    pipe_zero_copy_error(p);
+
+    PIPE_STAT(uint64_t start = pipe_stats_clock());
+
+    // Lock the pipe for read, it is unlocked in pipe_read_consume
+    pipe_lock(p, &p->state->read_lock);
+
+    while (true)
+    {
+        // Data written before close are visible once the close is seen
+        bool is_closed = pipe_is_closed(p);
+
+        size_t n = queue_read_region(pipe_read_queue(p), data);
+        if (n > 0)
+        {
+            *size = n;
+            PIPE_STAT(pipe_stats_read(p, 0, start));
+            return true;
+        }
+
+        if (is_closed)
+        {
+            break;
+        }
+
+        // Wait for data in buffer
+        pipe_unlock(p, &p->state->read_lock);
+        pipe_event_wait(p, &p->state->readable, pipe_readable, 1);
+        pipe_lock(p, &p->state->read_lock);
+    }
+
+    pipe_unlock(p, &p->state->read_lock);
+    PIPE_STAT(pipe_stats_read(p, 0, start));
+    return false;
+}
+
+// Free 'size' bytes of the peeked part
+void pipe_read_consume(struct pipe *p, uint size)
+{
+    pipe_null_read_error(p);
+
+    if (size > 0)
+    {
+        queue_read_commit(pipe_read_queue(p), size);
+        pipe_event_signal(p, &p->state->writable);
+        PIPE_STAT(pipe_stats_read(p, size, 0));
+    }
+
+    pipe_unlock(p, &p->state->read_lock);
+}
+
+// Read from file descriptor directly to the buffer
+ssize_t pipe_fill_from_fd(struct pipe *p, int fd, size_t max)
+{
+    pipe_null_write_error(p);
+    pipe_zero_copy_error(p);
+
+    if (max == 0)
+    {
+        return 0;
+    }
+
+    PIPE_STAT(uint64_t start = pipe_stats_clock());
+
+    // Lock the pipe for write
+    pipe_lock(p, &p->state->write_lock);
+
+    ssize_t result = -1;
+    while (true)
+    {
+        if (pipe_is_closed(p))
+        {
+            errno = EPIPE;
+            break;
+        }
+
+        struct queue *q = pipe_write_queue(p);
+        struct iovec iov[2];
+        int count = queue_write_iov(q, max, iov);
+        if (count > 0)
+        {
+            // The fd can block for long, other writers must not spin meanwhile
+            pipe_side_claim(p, &p->state->write_lock);
+            result = readv(fd, iov, count);
+            pipe_side_release(p, &p->state->write_lock);
+            if (result > 0)
+            {
+                queue_write_commit(q, result);
+                pipe_shrink_idle(p);
+                pipe_event_signal(p, &p->state->readable);
+            }
+            break;
+        }
+        if (pipe_grow(p, 1))
+        {
+            continue;
+        }
+
+        // Wait for space in buffer
+        pipe_unlock(p, &p->state->write_lock);
+        pipe_event_wait(p, &p->state->writable, pipe_writable, 1);
+        pipe_lock(p, &p->state->write_lock);
+    }
+
+    // Unlock the pipe
+    pipe_unlock(p, &p->state->write_lock);
+    PIPE_STAT(pipe_stats_write(p, result > 0 ? result : 0, start));
+    return result;
+}
+
+// Write data from the buffer directly to file descriptor
+ssize_t pipe_drain_to_fd(struct pipe *p, int fd, size_t max)
+{
+    pipe_null_read_error(p);
+    pipe_zero_copy_error(p);
+
+    if (max == 0)
+    {
+        return 0;
+    }
+
+    PIPE_STAT(uint64_t start = pipe_stats_clock());
+
+    // Lock the pipe for read
+    pipe_lock(p, &p->state->read_lock);
+
+    ssize_t result = 0;
+    while (true)
+    {
+        // Data written before close are visible once the close is seen
+        bool is_closed = pipe_is_closed(p);
+
+        struct queue *q = pipe_read_queue(p);
+        struct iovec iov[2];
+        int count = queue_read_iov(q, max, iov);
+        if (count > 0)
+        {
+            // The fd can block for long, other readers must not spin meanwhile
+            pipe_side_claim(p, &p->state->read_lock);
+            result = writev(fd, iov, count);
+            pipe_side_release(p, &p->state->read_lock);
+            if (result > 0)
+            {
+                queue_read_commit(q, result);
+                pipe_event_signal(p, &p->state->writable);
+            }
+            break;
+        }
+
+        if (is_closed)
+        {
+            break;
+        }
+
+        // Wait for data in buffer
+        pipe_unlock(p, &p->state->read_lock);
+        pipe_event_wait(p, &p->state->readable, pipe_readable, 1);
+        pipe_lock(p, &p->state->read_lock);
+    }
+
+    // Unlock the pipe
+    pipe_unlock(p, &p->state->read_lock);
+    PIPE_STAT(pipe_stats_read(p, result > 0 ? result : 0, start));
+    return result;
+}
+
+#pragma region MESSAGES
+
+// Write one message
+bool pipe_send_msg(struct pipe *p, unsigned char *data, uint size)
+{
+    pipe_null_write_error(p);
+
+    if (size > pipe_capacity(p) - MSG_HEADER_SIZE)
+    {
+        errorf("Unable to send message of %d bytes through pipe of size %zu\n",
+               size, pipe_capacity(p));
+    }
+
+    PIPE_STAT(uint64_t start = pipe_stats_clock());
+
+    // Lock the pipe for write
+    pipe_lock(p, &p->state->write_lock);
+
+    bool sent = false;
+    while (!pipe_is_closed(p))
+    {
+        sent = p->state->mode == PIPE_MODE_MPMC ? queue_mp_put_msg(p->queue, data, size)
+                                         : queue_put_msg(pipe_write_queue(p), data, size);
+        if (sent)
+        {
+            pipe_shrink_idle(p);
+            pipe_event_signal(p, &p->state->readable);
+            break;
+        }
+        if (pipe_grow(p, MSG_HEADER_SIZE + size))
+        {
+            continue;
+        }
+
+        // Wait for space for the whole message
+        pipe_unlock(p, &p->state->write_lock);
+        pipe_event_wait(p, &p->state->writable, pipe_writable, MSG_HEADER_SIZE + size);
+        pipe_lock(p, &p->state->write_lock);
+    }
+
+    // Unlock the pipe
+    pipe_unlock(p, &p->state->write_lock);
+    PIPE_STAT(pipe_stats_write(p, sent ? size : 0, start));
+    return sent;
+}
+
+// Read as many whole messages as fit to 'data'
+int pipe_recv_msgs(struct pipe *p, unsigned char *data, uint size, uint *lengths, uint count)
+{
+    pipe_null_read_error(p);
+
+    PIPE_STAT(uint64_t start = pipe_stats_clock());
+
+    // Lock the pipe for read
+    pipe_lock(p, &p->state->read_lock);
+
+    int n = 0;
+    while (count > 0)
+    {
+        // Data written before close are visible once the close is seen
+        bool is_closed = pipe_is_closed(p);
+
+        struct queue *q = pipe_read_queue(p);
+        atomic_size_t *tail = p->state->mode == PIPE_MODE_MPMC ? &q->reserve_tail : &q->tail;
+
+        n = p->state->mode == PIPE_MODE_MPMC ? queue_mc_get_msgs(q, data, size, lengths, count)
+                                      : queue_get_msgs(q, data, size, lengths, count);
+        if (n > 0)
+        {
+            pipe_event_signal(p, &p->state->writable);
+            break;
+        }
+
+        uint32_t length;
+        if (queue_peek_msg(q, tail, &length))
+        {
+            // The message does not fit, it is left for a call with a larger buffer
+            if (length > size)
+            {
+                lengths[0] = length;
+                errno = EMSGSIZE;
+                n = -1;
+                break;
+            }
+            // Other consumer took the message which did not fit, try the next one
+            continue;
+        }
+
+        if (is_closed)
+        {
+            break;
+        }
+
+        // Wait for a message
+        pipe_unlock(p, &p->state->read_lock);
+        pipe_event_wait(p, &p->state->readable, pipe_readable, MSG_HEADER_SIZE);
+        pipe_lock(p, &p->state->read_lock);
+    }
+
+    // Unlock the pipe
+    pipe_unlock(p, &p->state->read_lock);
+    PIPE_STAT(pipe_stats_read(p, n > 0 ? pipe_stats_sum(lengths, n) : 0, start));
+    return n;
+}
+
+// Read one message
+int pipe_recv_msg(struct pipe *p, unsigned char *data, uint size, uint *length)
+{
+    return pipe_recv_msgs(p, data, size, length, 1);
+}
+
+// Wait for a message and get its length
+bool pipe_peek_msg_size(struct pipe *p, uint *length)
+{
+    pipe_null_read_error(p);
+
+    PIPE_STAT(uint64_t start = pipe_stats_clock());
+
+    // Lock the pipe for read
+    pipe_lock(p, &p->state->read_lock);
+
+    bool found = false;
+    while (true)
+    {
+        // Data written before close are visible once the close is seen
+        bool is_closed = pipe_is_closed(p);
+
+        struct queue *q = pipe_read_queue(p);
+        atomic_size_t *tail = p->state->mode == PIPE_MODE_MPMC ? &q->reserve_tail : &q->tail;
+
+        uint32_t next;
+        if (queue_peek_msg(q, tail, &next))
+        {
+            *length = next;
+            found = true;
+            break;
+        }
+
+        if (is_closed)
+        {
+            break;
+        }
+
+        // Wait for a message
+        pipe_unlock(p, &p->state->read_lock);
+        pipe_event_wait(p, &p->state->readable, pipe_readable, MSG_HEADER_SIZE);
+        pipe_lock(p, &p->state->read_lock);
+    }
+
+    // Unlock the pipe
+    pipe_unlock(p, &p->state->read_lock);
+    PIPE_STAT(pipe_stats_read(p, 0, start));
+    return found;
+}
+
+#pragma endregion
+
+// Write as much as fits to the buffer without waiting
+uint pipe_try_write(struct pipe *p, unsigned char *data, uint size)
+{
+    pipe_null_write_error(p);
+
+    if (pipe_is_closed(p))
+    {
+        return 0;
+    }
+
+    if (!pipe_try_lock(p, &p->state->write_lock))
+    {
+        return 0;
+    }
+
+    uint written = 0;
+    while (written < size)
+    {
+        size_t n = pipe_queue_write(p, data + written, size - written);
+        if (n == 0 && !pipe_grow(p, pipe_write_piece(p, size - written)))
+        {
+            break;
+        }
+        written += n;
+    }
+
+    if (written > 0)
+    {
+        pipe_shrink_idle(p);
+        pipe_event_signal(p, &p->state->readable);
+    }
+
+    pipe_unlock(p, &p->state->write_lock);
+    PIPE_STAT(pipe_stats_write(p, written, 0));
+    return written;
+}
+
+// Read what is in the buffer without waiting
+uint pipe_try_read(struct pipe *p, unsigned char *data, uint size)
+{
+    pipe_null_read_error(p);
+
+    if (!pipe_try_lock(p, &p->state->read_lock))
+    {
+        return 0;
+    }
+
+    uint read = pipe_queue_read(p, data, size);
+    if (read > 0)
+    {
+        pipe_event_signal(p, &p->state->writable);
+    }
+
+    pipe_unlock(p, &p->state->read_lock);
+    if (read == 0)
+    {
+        // Readers which poll the pipe shrink it while it is idle
+        pipe_elastic_idle(p);
+    }
+    PIPE_STAT(pipe_stats_read(p, read, 0));
+    return read;
+}
+
+#ifdef PIPE_STATS
+// Get statistics of the pipe, counters of concurrent calls can be partly updated
+void pipe_stats(struct pipe *p, struct pipe_stats *stats)
+{
+    pipe_null_error(p, "measure");
+
+    pipe_stats_snapshot(&p->state->write_counters, &stats->write);
+    pipe_stats_snapshot(&p->state->read_counters, &stats->read);
+    stats->high_water = atomic_load_explicit(&p->state->high_water, memory_order_relaxed);
+}
+
+// Set all statistics of the pipe to zero
+void pipe_stats_reset(struct pipe *p)
+{
+    pipe_null_error(p, "measure");
+
+    pipe_stats_clear(&p->state->write_counters);
+    pipe_stats_clear(&p->state->read_counters);
+    atomic_store_explicit(&p->state->high_water, 0, memory_order_relaxed);
+}
+#endif
+
+#pragma region WAITSET
+
+struct pipe_waitset *pipe_waitset_create()
+{
+    struct pipe_waitset *ws = malloc(sizeof(struct pipe_waitset));
+    if (ws == NULL)
+    {
+        error("Unable to allocate memory for new wait-set\n");
+    }
+
+    pthread_once(&membarrier_once, membarrier_register);
+
+    atomic_init(&ws->seq, 0);
+    atomic_init(&ws->waiters, 0);
+    pthread_mutex_init(&ws->lock, NULL);
+    ws->watched = NULL;
+    ws->count = 0;
+    ws->capacity = 0;
+    return ws;
+}
+
+// Writers in other processes do not notify watchers of this process
+void pipe_shared_watch_error(struct pipe *p)
+{
+    if (p->state->shared)
+    {
+        error("Shared pipe can not be watched\n");
+    }
+}
+
+// Start watching the pipe
+void pipe_waitset_add(struct pipe_waitset *ws, struct pipe *p, int events)
+{
+    pipe_null_error(p, "watch");
+    pipe_shared_watch_error(p);
+
+    struct pipe_watch *w = malloc(sizeof(struct pipe_watch));
+    if (w == NULL)
+    {
+        error("Unable to allocate memory for pipe watch\n");
+    }
+    w->waitset = ws;
+
+    pthread_mutex_lock(&ws->lock);
+    if (ws->count == ws->capacity)
+    {
+        int capacity = ws->capacity == 0 ? 8 : 2 * ws->capacity;
+        struct pipe_ready *watched = realloc(ws->watched, capacity * sizeof(struct pipe_ready));
+        if (watched == NULL)
+        {
+            error("Unable to allocate memory for wait-set\n");
+        }
+        ws->watched = watched;
+        ws->capacity = capacity;
+    }
+    ws->watched[ws->count].pipe = p;
+    ws->watched[ws->count].events = events;
+    ws->count++;
+    pthread_mutex_unlock(&ws->lock);
+
+    pthread_mutex_lock(&p->watch_lock);
+    w->next = p->watches;
+    p->watches = w;
+    pthread_mutex_unlock(&p->watch_lock);
+
+    // Writers check 'watchers' without a fence of their own
+    atomic_fetch_add_explicit(&p->watchers, 1, memory_order_seq_cst);
+    sleep_fence(false);
+}
+
+// Stop watching the pipe
+void pipe_waitset_remove(struct pipe_waitset *ws, struct pipe *p)
+{
+    pthread_mutex_lock(&ws->lock);
+    for (int i = 0; i < ws->count; i++)
+    {
+        if (ws->watched[i].pipe == p)
+        {
+            ws->watched[i] = ws->watched[--ws->count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ws->lock);
+
+    pthread_mutex_lock(&p->watch_lock);
+    for (struct pipe_watch **w = &p->watches; *w != NULL; w = &(*w)->next)
+    {
+        if ((*w)->waitset == ws)
+        {
+            struct pipe_watch *removed = *w;
+            *w = removed->next;
+            free(removed);
+            atomic_fetch_sub_explicit(&p->watchers, 1, memory_order_relaxed);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&p->watch_lock);
+}
+
+// Get events of the pipe which are ready now
+int pipe_ready_events(struct pipe *p, int events)
+{
+    int ready = 0;
+    if ((events & PIPE_READABLE) && pipe_can_read(p, 1))
+    {
+        ready |= PIPE_READABLE;
+    }
+    if ((events & PIPE_WRITABLE) && pipe_can_write(p, 1))
+    {
+        ready |= PIPE_WRITABLE;
+    }
+    if (pipe_is_closed(p))
+    {
+        ready |= PIPE_CLOSED;
+    }
+    return ready;
+}
+
+// Store at most 'count' ready pipes to 'ready', returns their number
+int pipe_waitset_poll(struct pipe_waitset *ws, struct pipe_ready *ready, int count)
+{
+    int n = 0;
+
+    pthread_mutex_lock(&ws->lock);
+    for (int i = 0; i < ws->count && n < count; i++)
+    {
+        int events = pipe_ready_events(ws->watched[i].pipe, ws->watched[i].events);
+        if (events != 0)
+        {
+            ready[n].pipe = ws->watched[i].pipe;
+            ready[n].events = events;
+            n++;
+        }
+    }
+    pthread_mutex_unlock(&ws->lock);
+
+    return n;
+}
+
+// Wait until some pipe is ready or timeout (in milliseconds) passes
+int pipe_waitset_wait(struct pipe_waitset *ws, struct pipe_ready *ready, int count, int timeout)
+{
+    struct timespec deadline;
+    if (timeout >= 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (timeout % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    while (true)
+    {
+        uint seq = atomic_load_explicit(&ws->seq, memory_order_acquire);
+        atomic_fetch_add_explicit(&ws->waiters, 1, memory_order_relaxed);
+        sleep_fence(false);
+
+        int n = pipe_waitset_poll(ws, ready, count);
+        if (n > 0)
+        {
+            atomic_fetch_sub_explicit(&ws->waiters, 1, memory_order_relaxed);
+            return n;
+        }
+
+        struct timespec remaining;
+        if (timeout >= 0)
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            remaining.tv_sec = deadline.tv_sec - now.tv_sec;
+            remaining.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (remaining.tv_nsec < 0)
+            {
+                remaining.tv_sec--;
+                remaining.tv_nsec += 1000000000L;
+            }
+            if (remaining.tv_sec < 0)
+            {
+                atomic_fetch_sub_explicit(&ws->waiters, 1, memory_order_relaxed);
+                return 0;
+            }
+        }
+
+        futex_wait_timeout(&ws->seq, seq, false, timeout >= 0 ? &remaining : NULL);
+        atomic_fetch_sub_explicit(&ws->waiters, 1, memory_order_relaxed);
+    }
+}
+
+void pipe_waitset_free(struct pipe_waitset *ws)
+{
+    while (ws->count > 0)
+    {
+        pipe_waitset_remove(ws, ws->watched[ws->count - 1].pipe);
+    }
+
+    pthread_mutex_destroy(&ws->lock);
+    free(ws->watched);
+    free(ws);
+}
+
+// Get eventfd which is signalled when the pipe has new data or it is closed
+int pipe_eventfd(struct pipe *p)
+{
+    pipe_null_error(p, "watch");
+    pipe_shared_watch_error(p);
+
+    pthread_mutex_lock(&p->watch_lock);
+    if (p->eventfd == -1)
+    {
+        p->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (p->eventfd == -1)
+        {
+            error("Unable to create eventfd for pipe\n");
+        }
+
+        // Data written before the eventfd existed must be reported too
+        atomic_store_explicit(&p->eventfd_pending, true, memory_order_relaxed);
+        eventfd_write(p->eventfd, 1);
+        atomic_fetch_add_explicit(&p->watchers, 1, memory_order_seq_cst);
+        sleep_fence(false);
+    }
+    pthread_mutex_unlock(&p->watch_lock);
+
+    return p->eventfd;
+}
+
+// Reset the eventfd, must be called before the pipe is read
+void pipe_eventfd_ack(struct pipe *p)
+{
+    pipe_null_error(p, "watch");
+
+    eventfd_t value;
+    eventfd_read(p->eventfd, &value);
+
+    // Exchange pairs with the writer's exchange, so its data are visible after it
+    atomic_exchange_explicit(&p->eventfd_pending, false, memory_order_acq_rel);
+}
+
+#pragma endregion
+
+// Close pipe
+void pipe_close(struct pipe *p)
+{
+    pipe_null_error(p, "close");
+    atomic_store_explicit(&p->state->is_closed, true, memory_order_release);
+
+    // Wake up everybody who is waiting
+    pipe_event_signal(p, &p->state->readable);
+    pipe_event_signal(p, &p->state->writable);
+}
+
+// Completle unallocate memory for pipe
+void pipe_free(struct pipe *p)
+{
+    pipe_null_error(p, "free");
+
+    // Other processes can still use the state of a shared pipe
+    if (!p->state->shared)
+    {
+        pthread_spin_destroy(&p->state->write_lock);
+        pthread_spin_destroy(&p->state->read_lock);
+        pipe_event_destroy(&p->state->readable);
+        pipe_event_destroy(&p->state->writable);
+    }
+
+    while (p->watches != NULL)
+    {
+        struct pipe_watch *next = p->watches->next;
+        free(p->watches);
+        p->watches = next;
+    }
+    pthread_mutex_destroy(&p->watch_lock);
+    if (p->eventfd != -1)
+    {
+        close(p->eventfd);
+    }
+
+    if (p->elastic != NULL)
+    {
+        struct pipe_ring *r = p->elastic->retired;
+        while (r != NULL)
+        {
+            struct pipe_ring *next = atomic_load_explicit(&r->next, memory_order_relaxed);
+            free(r);
+            r = next;
+        }
+        free(p->elastic);
+    }
+
+    if (p->mapping != NULL)
+    {
+        munmap(p->mapping, p->mapping_size);
+    }
+    else
+    {
+        free(p->state);
+    }
+    if (p->shm_name != NULL)
+    {
+        shm_unlink(p->shm_name);
+        free(p->shm_name);
+    }
+
+    free(p);
+}
+
+#pragma region PIPELINE
+
+#define PIPELINE_DEFAULT_CAPACITY (65536)
+#define PIPELINE_DEFAULT_BATCH (4096)
+
+struct pipeline_worker;
+
+// One step of the pipeline, run by 'parallelism' threads at once
+struct pipeline_stage
+{
+    void (*fn)(struct pipeline_worker *w, void *arg);
+    void *arg;
+    int parallelism;
+    // Size of the pipe to the next stage
+    uint capacity;
+    // Writes shorter than 'batch' are collected and written together, 0 disables
+    uint batch;
+    // Threads are pinned to CPUs from 'cpu' on, -1 if they are not pinned
+    int cpu;
+    // Pipe from the previous stage, NULL for the first stage
+    struct pipe *input;
+    // Pipe to the next stage, NULL for the last stage
+    struct pipe *output;
+    // Number of threads which did not finish yet, the last one closes the pipes
+    atomic_int running;
+    struct pipeline_worker *workers;
+};
+
+// Thread of a stage, passed to the stage function
+struct pipeline_worker
+{
+    struct pipeline_stage *stage;
+    // Index of the thread in its stage, from 0 to parallelism - 1
+    int index;
+    pthread_t thread;
+    unsigned char *batch;
+    uint batched;
+};
+
+// Threads connected with pipes, every stage reads from the previous one
+struct pipeline
+{
+    struct pipeline_stage *stages;
+    int count;
+    int capacity;
+    bool started;
+};
+
+struct pipeline *pipeline_create()
+{
+    struct pipeline *pl = malloc(sizeof(struct pipeline));
+    if (pl == NULL)
+    {
+        error("Unable to allocate memory for new pipeline\n");
+    }
+
+    pl->stages = NULL;
+    pl->count = 0;
+    pl->capacity = 0;
+    pl->started = false;
+    return pl;
+}
+
+// Get stage of the pipeline which was not started yet
+struct pipeline_stage *pipeline_stage(struct pipeline *pl, int stage)
+{
+    if (pl == NULL)
+    {
+        error("Unable to configure NULL pipeline\n");
+    }
+    if (pl->started)
+    {
+        error("Unable to configure running pipeline\n");
+    }
+    if (stage < 0 || stage >= pl->count)
+    {
+        errorf("Pipeline has no stage %d\n", stage);
+    }
+    return &pl->stages[stage];
+}
+
+// Add stage run by 'parallelism' threads, returns its index
+int pipeline_add_stage(
+    struct pipeline *pl, void (*fn)(struct pipeline_worker *w, void *arg), void *arg,
+    int parallelism)
+{
+    if (pl == NULL)
+    {
+        error("Unable to add stage to NULL pipeline\n");
+    }
+    if (pl->started)
+    {
+        error("Unable to add stage to running pipeline\n");
+    }
+    if (parallelism < 1)
+    {
+        errorf("Unable to add stage with %d threads\n", parallelism);
+    }
+
+    if (pl->count == pl->capacity)
+    {
+        int capacity = pl->capacity == 0 ? 4 : 2 * pl->capacity;
+        struct pipeline_stage *stages =
+            realloc(pl->stages, capacity * sizeof(struct pipeline_stage));
+        if (stages == NULL)
+        {
+            error("Unable to allocate memory for pipeline stage\n");
+        }
+        pl->stages = stages;
+        pl->capacity = capacity;
+    }
+
+    struct pipeline_stage *s = &pl->stages[pl->count];
+    s->fn = fn;
+    s->arg = arg;
+    s->parallelism = parallelism;
+    s->capacity = PIPELINE_DEFAULT_CAPACITY;
+    s->batch = PIPELINE_DEFAULT_BATCH;
+    s->cpu = -1;
+    s->input = NULL;
+    s->output = NULL;
+    s->workers = NULL;
+    return pl->count++;
+}
+
+// Set size of the pipe from 'stage' to the next stage
+void pipeline_set_capacity(struct pipeline *pl, int stage, uint capacity)
+{
+    if (capacity == 0)
+    {
+        error("Unable to connect stages with pipe of size 0\n");
+    }
+    pipeline_stage(pl, stage)->capacity = capacity;
+}
+
+// Set how many bytes 'stage' collects before it writes them, 0 disables batching
+void pipeline_set_batch(struct pipeline *pl, int stage, uint batch)
+{
+    pipeline_stage(pl, stage)->batch = batch;
+}
+
+// Pin threads of 'stage' to CPUs 'cpu', 'cpu' + 1, ... (modulo number of CPUs)
+void pipeline_pin(struct pipeline *pl, int stage, int cpu)
+{
+    pipeline_stage(pl, stage)->cpu = cpu;
+}
+
+// Write collected data of the worker to the next stage
+bool pipeline_flush(struct pipeline_worker *w)
+{
+    if (w->batched == 0)
+    {
+        return true;
+    }
+
+    uint size = w->batched;
+    w->batched = 0;
+    return pipe_write(w->stage->output, w->batch, size) == size;
+}
+
+// Write to the next stage, every write is read by one thread of the next stage as
+// a whole if it is not longer than the pipe
+bool pipeline_write(struct pipeline_worker *w, unsigned char *data, uint size)
+{
+    struct pipeline_stage *s = w->stage;
+    if (s->output == NULL)
+    {
+        error("Unable to write from the last stage of pipeline\n");
+    }
+
+    if (size > s->batch)
+    {
+        return pipeline_flush(w) && pipe_write(s->output, data, size) == size;
+    }
+
+    if (w->batched + size > s->batch && !pipeline_flush(w))
+    {
+        return false;
+    }
+    memcpy(w->batch + w->batched, data, size);
+    w->batched += size;
+    return true;
+}
+
+// Send one message to the next stage, it is read by pipeline_recv_msg as a whole
+bool pipeline_send_msg(struct pipeline_worker *w, unsigned char *data, uint size)
+{
+    struct pipeline_stage *s = w->stage;
+    if (s->output == NULL)
+    {
+        error("Unable to write from the last stage of pipeline\n");
+    }
+
+    // Collected messages are stored the same way as in the pipe
+    if (MSG_HEADER_SIZE + size > s->batch)
+    {
+        return pipeline_flush(w) && pipe_send_msg(s->output, data, size);
+    }
+
+    if (w->batched + MSG_HEADER_SIZE + size > s->batch && !pipeline_flush(w))
+    {
+        return false;
+    }
+    uint32_t length = size;
+    memcpy(w->batch + w->batched, &length, MSG_HEADER_SIZE);
+    memcpy(w->batch + w->batched + MSG_HEADER_SIZE, data, size);
+    w->batched += MSG_HEADER_SIZE + size;
+    return true;
+}
+
+// Read from the previous stage, collected writes are flushed before waiting
+uint pipeline_read(struct pipeline_worker *w, unsigned char *data, uint size)
+{
+    struct pipeline_stage *s = w->stage;
+    if (s->input == NULL)
+    {
+        error("Unable to read to the first stage of pipeline\n");
+    }
+
+    // The next stage may wait for the collected data
+    if (w->batched > 0 && !pipe_can_read(s->input, size))
+    {
+        pipeline_flush(w);
+    }
+    return pipe_read(s->input, data, size);
+}
+
+// Read one message from the previous stage, see pipe_recv_msg
+int pipeline_recv_msg(struct pipeline_worker *w, unsigned char *data, uint size, uint *length)
+{
+    struct pipeline_stage *s = w->stage;
+    if (s->input == NULL)
+    {
+        error("Unable to read to the first stage of pipeline\n");
+    }
+
+    if (w->batched > 0 && !pipe_can_read(s->input, MSG_HEADER_SIZE))
+    {
+        pipeline_flush(w);
+    }
+    return pipe_recv_msg(s->input, data, size, length);
+}
+
+void *pipeline_worker_main(void *arg)
+{
+    struct pipeline_worker *w = (struct pipeline_worker *)arg;
+    struct pipeline_stage *s = w->stage;
+
+    s->fn(w, s->arg);
+    if (s->output != NULL)
+    {
+        pipeline_flush(w);
+    }
+
+    // The last thread of the stage tells the next stage there is nothing more and
+    // the previous stage there is nobody to read
+    if (atomic_fetch_sub_explicit(&s->running, 1, memory_order_acq_rel) == 1)
+    {
+        if (s->output != NULL)
+        {
+            pipe_close(s->output);
+        }
+        if (s->input != NULL)
+        {
+            pipe_close(s->input);
+        }
+    }
+    return NULL;
+}
+
+// Connect the stages and start all threads
+void pipeline_run(struct pipeline *pl)
+{
+    if (pl == NULL || pl->count == 0)
+    {
+        error("Unable to run empty pipeline\n");
+    }
+    if (pl->started)
+    {
+        error("Pipeline is already running\n");
+    }
+    pl->started = true;
+
+    // One writer and one reader do not need locks, other pipes keep every write of
+    // at most the pipe size in one piece
+    for (int i = 0; i + 1 < pl->count; i++)
+    {
+        struct pipeline_stage *s = &pl->stages[i];
+        struct pipeline_stage *next = &pl->stages[i + 1];
+        s->output = s->parallelism == 1 && next->parallelism == 1
+                        ? pipe_create_spsc(s->capacity)
+                        : pipe_create_mpmc(s->capacity, s->capacity);
+        next->input = s->output;
+        if (s->batch > s->capacity)
+        {
+            s->batch = s->capacity;
+        }
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 0; i < pl->count; i++)
+    {
+        struct pipeline_stage *s = &pl->stages[i];
+        atomic_init(&s->running, s->parallelism);
+        s->workers = calloc(s->parallelism, sizeof(struct pipeline_worker));
+        if (s->workers == NULL)
+        {
+            error("Unable to allocate memory for pipeline threads\n");
+        }
+
+        for (int j = 0; j < s->parallelism; j++)
+        {
+            struct pipeline_worker *w = &s->workers[j];
+            w->stage = s;
+            w->index = j;
+            w->batched = 0;
+            w->batch = NULL;
+            if (s->output != NULL && s->batch > 0)
+            {
+                w->batch = malloc(s->batch);
+                if (w->batch == NULL)
+                {
+                    error("Unable to allocate memory for pipeline batch\n");
+                }
+            }
+
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            if (s->cpu >= 0 && cpus > 0)
+            {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                long cpu = (s->cpu + j) % cpus;
+                CPU_SET(cpu, &set);
+                if (pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &set) != 0)
+                {
+                    errorf("Unable to pin pipeline thread to CPU %ld\n", cpu);
+                }
+            }
+            if (pthread_create(&w->thread, &attr, pipeline_worker_main, w) != 0)
+            {
+                error("Unable to start pipeline thread\n");
+            }
+            pthread_attr_destroy(&attr);
+        }
+    }
+}
+
+// Wait until all threads of the pipeline finish
+void pipeline_wait(struct pipeline *pl)
+{
+    if (pl == NULL || !pl->started)
+    {
+        error("Unable to wait for pipeline which is not running\n");
+    }
+
+    for (int i = 0; i < pl->count; i++)
+    {
+        struct pipeline_stage *s = &pl->stages[i];
+        for (int j = 0; j < s->parallelism; j++)
+        {
+            pthread_join(s->workers[j].thread, NULL);
+        }
+    }
+}
+
+// Free the pipeline, it must not be running
+void pipeline_free(struct pipeline *pl)
+{
+    if (pl == NULL)
+    {
+        error("Unable to free NULL pipeline\n");
+    }
+
+    for (int i = 0; i < pl->count; i++)
+    {
+        struct pipeline_stage *s = &pl->stages[i];
+        if (s->output != NULL)
+        {
+            pipe_free(s->output);
+        }
+        if (s->workers != NULL)
+        {
+            for (int j = 0; j < s->parallelism; j++)
+            {
+                free(s->workers[j].batch);
+            }
+            free(s->workers);
+        }
+    }
+    free(pl->stages);
+    free(pl);
+}
+
+#pragma endregion
+
+#ifdef PIPE_BENCH
+#pragma region BENCHMARK
+
+#define BENCH_PING_PONGS (20000)
+#define BENCH_MAX_THREADS (16)
+// Elastic pipes start at this size (or the capacity if smaller) and grow up to the
+// capacity
+#define BENCH_ELASTIC_MIN (4096)
+
+// Buffer behind the measured pipe
+enum bench_backing
+{
+    BENCH_PLAIN,
+    BENCH_MIRRORED,
+    BENCH_ELASTIC,
+};
+
+// Thread of a throughput benchmark, moves 'size' bytes in 'chunk' bytes long calls
+struct bench_worker
+{
+    pthread_t thread;
+    struct pipe *pipe;
+    unsigned char *buffer;
+    size_t chunk;
+    size_t size;
+};
+
+void *bench_writer(void *arg)
+{
+    struct bench_worker *w = (struct bench_worker *)arg;
+    for (size_t done = 0; done < w->size; done += w->chunk)
+    {
+        size_t chunk = w->size - done < w->chunk ? w->size - done : w->chunk;
+        pipe_write(w->pipe, w->buffer, chunk);
+    }
+    return NULL;
+}
+
+void *bench_reader(void *arg)
+{
+    struct bench_worker *w = (struct bench_worker *)arg;
+    uint n;
+    while ((n = pipe_read(w->pipe, w->buffer, w->chunk)) > 0)
+    {
+        w->size += n;
+    }
+    return NULL;
+}
+
+double bench_seconds(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+const char *bench_mode_name(enum pipe_mode mode)
+{
+    return mode == PIPE_MODE_LOCKED ? "locked" : mode == PIPE_MODE_SPSC ? "spsc" : "mpmc";
+}
+
+const char *bench_backing_name(enum bench_backing backing)
+{
+    return backing == BENCH_PLAIN ? "plain" : backing == BENCH_MIRRORED ? "mirrored" : "elastic";
+}
+
+struct pipe *bench_pipe(enum pipe_mode mode, enum bench_backing backing, uint capacity, uint chunk)
+{
+    if (backing == BENCH_ELASTIC)
+    {
+        uint min = capacity < BENCH_ELASTIC_MIN ? capacity : BENCH_ELASTIC_MIN;
+        return pipe_create_elastic(min, capacity, mode);
+    }
+
+    struct pipe *p = pipe_create_mode(capacity, mode, backing == BENCH_MIRRORED);
+    if (mode == PIPE_MODE_MPMC)
+    {
+        // Same as pipe_create_mpmc, which creates only plain pipes
+        p->state->atomic_size = chunk < capacity ? chunk : capacity;
+    }
+    return p;
+}
+
+// Move 'total' bytes from 'writers' to 'readers' threads, prints MB/s
+void bench_throughput(enum pipe_mode mode, enum bench_backing backing, uint capacity, uint chunk,
+                      int writers, int readers, size_t total)
+{
+    struct pipe *p = bench_pipe(mode, backing, capacity, chunk);
+    struct bench_worker w[BENCH_MAX_THREADS], r[BENCH_MAX_THREADS];
+
+    for (int i = 0; i < writers + readers; i++)
+    {
+        struct bench_worker *worker = i < writers ? &w[i] : &r[i - writers];
+        worker->pipe = p;
+        worker->chunk = chunk;
+        worker->size = i < writers ? total / writers : 0;
+        worker->buffer = calloc(chunk, 1);
+        if (worker->buffer == NULL)
+        {
+            error("Unable to allocate memory for benchmark\n");
+        }
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < readers; i++)
+    {
+        pthread_create(&r[i].thread, NULL, bench_reader, &r[i]);
+    }
+    for (int i = 0; i < writers; i++)
+    {
+        pthread_create(&w[i].thread, NULL, bench_writer, &w[i]);
+    }
+    for (int i = 0; i < writers; i++)
+    {
+        pthread_join(w[i].thread, NULL);
+    }
+    pipe_close(p);
+
+    size_t moved = 0;
+    for (int i = 0; i < readers; i++)
+    {
+        pthread_join(r[i].thread, NULL);
+        moved += r[i].size;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (moved != total / writers * writers)
+    {
+        errorf("Benchmark lost data, %zu of %zu bytes were read\n", moved, total);
+    }
+
+    printf("throughput,%s,%s,%u,%u,%d,%d,%zu,%.1f,,,\n", bench_mode_name(mode),
+           bench_backing_name(backing), capacity, chunk, writers, readers, total >> 20,
+           moved / bench_seconds(&start, &end) / 1e6);
+    fflush(stdout);
+
+    for (int i = 0; i < writers + readers; i++)
+    {
+        free(i < writers ? w[i].buffer : r[i - writers].buffer);
+    }
+    pipe_free(p);
+}
+
+// Echo thread of the ping-pong benchmark
+struct bench_echo
+{
+    struct pipe *ping;
+    struct pipe *pong;
+    uint chunk;
+};
+
+void *bench_echo(void *arg)
+{
+    struct bench_echo *e = (struct bench_echo *)arg;
+    unsigned char *buffer = calloc(e->chunk, 1);
+    while (pipe_read(e->ping, buffer, e->chunk) == e->chunk)
+    {
+        pipe_write(e->pong, buffer, e->chunk);
+    }
+    free(buffer);
+    return NULL;
+}
+
+int bench_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Send 'chunk' bytes to other thread and back, prints round trip percentiles
+void bench_latency(enum pipe_mode mode, enum bench_backing backing, uint capacity, uint chunk)
+{
+    struct bench_echo e = {bench_pipe(mode, backing, capacity, chunk),
+                           bench_pipe(mode, backing, capacity, chunk), chunk};
+    unsigned char *buffer = calloc(chunk, 1);
+    uint64_t *times = malloc(BENCH_PING_PONGS * sizeof(uint64_t));
+    if (buffer == NULL || times == NULL)
+    {
+        error("Unable to allocate memory for benchmark\n");
+    }
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, bench_echo, &e);
+    for (int i = 0; i < BENCH_PING_PONGS; i++)
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pipe_write(e.ping, buffer, chunk);
+        pipe_read(e.pong, buffer, chunk);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        times[i] = (end.tv_sec - start.tv_sec) * 1000000000ull + end.tv_nsec - start.tv_nsec;
+    }
+    pipe_close(e.ping);
+    pthread_join(thread, NULL);
+
+    qsort(times, BENCH_PING_PONGS, sizeof(uint64_t), bench_compare);
+    printf("latency,%s,%s,%u,%u,1,1,,,%lu,%lu,%lu\n", bench_mode_name(mode),
+           bench_backing_name(backing), capacity, chunk,
+           (unsigned long)times[BENCH_PING_PONGS / 2],
+           (unsigned long)times[BENCH_PING_PONGS * 99 / 100],
+           (unsigned long)times[BENCH_PING_PONGS * 999 / 1000]);
+    fflush(stdout);
+
+    free(times);
+    free(buffer);
+    pipe_free(e.ping);
+    pipe_free(e.pong);
+}
+
+// Benchmark of pipes, prints one CSV line per measurement:
+//
+//      gcc -O2 -DPIPE_BENCH -pthread petrzela-tomas-1-lin.c -o pipe_bench
+//      ./pipe_bench [megabytes per throughput measurement, 64 by default]
+int main(int argc, char **argv)
+{
+    size_t total = (argc > 1 ? strtoul(argv[1], NULL, 10) : 64) << 20;
+    if (total == 0)
+    {
+        error("Usage: pipe_bench [megabytes]\n");
+    }
+
+    uint capacities[] = {4096, 65536, 1 << 20};
+    uint chunks[] = {64, 4096, 65536};
+    int threads[] = {1, 2, 4, 8, BENCH_MAX_THREADS};
+    int thread_counts = sizeof(threads) / sizeof(threads[0]);
+    enum pipe_mode modes[] = {PIPE_MODE_LOCKED, PIPE_MODE_SPSC, PIPE_MODE_MPMC};
+    enum bench_backing backings[] = {BENCH_PLAIN, BENCH_MIRRORED, BENCH_ELASTIC};
+
+    printf("test,mode,backing,capacity,chunk,writers,readers,megabytes,mb_per_s,p50_ns,p99_ns,"
+           "p999_ns\n");
+    for (int m = 0; m < 3; m++)
+    {
+        for (int b = 0; b < 3; b++)
+        {
+            // Elastic pipes can not be MPMC
+            if (modes[m] == PIPE_MODE_MPMC && backings[b] == BENCH_ELASTIC)
+            {
+                continue;
+            }
+
+            for (int c = 0; c < 3; c++)
+            {
+                for (int k = 0; k < 3; k++)
+                {
+                    // Every number of writers with every number of readers, SPSC
+                    // pipes allow only one of each
+                    int counts = modes[m] == PIPE_MODE_SPSC ? 1 : thread_counts;
+                    for (int t = 0; t < counts; t++)
+                    {
+                        for (int u = 0; u < counts; u++)
+                        {
+                            bench_throughput(modes[m], backings[b], capacities[c], chunks[k],
+                                             threads[t], threads[u], total);
+                        }
+                    }
+                    bench_latency(modes[m], backings[b], capacities[c], chunks[k]);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+#pragma endregion
+#endif
+
 /*
 void *test_fn_write(void *arg)
 {
@@ -319,7 +3844,7 @@ void *test_fn_read(void *arg)
             data[i] = 0;
         }
 
-        if (p->is_closed)
+        if (p->state->is_closed)
         {
             break;
         }
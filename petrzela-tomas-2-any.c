@@ -9,21 +9,109 @@
 // ASCII file. The third argument is a string of ASCII characters that will be used to
 // represent the different gray levels in the image.
 //
-// pgm file support comments. Comments are lines that start with #.
+// The char set may have any length, the gray levels are spread evenly over it (a
+// char set of n + 1 characters has one character for every gray level). With
+// --gamma G the gray levels are raised to G first, G above 1 darkens the image.
+// The character of every gray level is computed before the conversion.
+//
+// With --cols N and/or --rows N the image is downscaled, every character is the
+// average of a box of pixels. If only one of them is given, the other keeps the
+// aspect ratio of the image for characters twice as high as wide. The sums of the
+// columns of the image are kept for one band of rows only, so the memory does not
+// grow with the height of the image. The downscaled image is made by one thread.
+//
+// pgm file support comments. Comments start with # and end at the end of the line.
+// If there are at most 10 gray levels, the gray levels do not have to be separated
+// by spaces, every digit is one pixel then. The first number of the raster decides
+// it: the digits are packed if it has a nonzero digit before its last one (it would
+// be over scale) or if it has at least two digits and is at least as long as a row.
+// Otherwise the numbers are separated, a leading zero is allowed, and a number
+// over scale is an error. Digits after the last pixel are an error.
+//
+// Binary pgm files (P5) are supported too. Their raster has one byte per pixel, or
+// two bytes (most significant first) if there are more than 256 gray levels. With
+// at most 16 gray levels the bytes are mapped to characters by a shuffle, 16 bytes
+// at a time with SSSE3 or 32 with AVX2, otherwise by a table.
+//
+// If the input and the output are regular files, both are mapped to memory. The
+// size of the output is computed from the header, so the image is converted right
+// from the input file to the output file. Otherwise the input is read and converted
+// in chunks, so the program uses the same amount of memory for any size of the
+// image. Use - as the input or output file to read from the standard input or
+// write to the standard output.
+//
+// Chunks are double buffered, chunk k is converted while chunk k + 1 is read and
+// chunk k - 1 is written. In linux the reads and writes are done by io_uring (by
+// raw system calls, compile with -DNO_IO_URING to not use it), or by a thread for
+// reads and a thread for writes if the kernel has no io_uring. In windows they are
+// done synchronously.
+//
+// Digits and whitespaces are found 16 bytes at a time with SSE2, or 32 bytes with
+// AVX2 when compiled with -mavx2 (or -march=native). Without them, or for parts
+// with comments, the raster is converted byte by byte.
+//
+// With --threads N the raster is read in windows, which are split after whitespaces
+// into N parts. The pixels of every part are counted in parallel, so the offset of
+// every part in the output is known and the parts are converted in parallel right
+// to their place. The output is the same as with one thread. Windows with comments
+// are converted by one thread, as comments may contain digits.
 //
 // The program is first written to work in linux. Then it is modified to work in
 // windows.
 //
+// With --batch many files are converted by one process. The input is a directory,
+// every .pgm file of it is converted to a .txt file in the output directory, or a
+// manifest with an input and an output path on every line (the output directory is
+// - then). The files are converted by a pool of threads, one per core or --threads
+// N, every thread has its own buffers for all of its files. A file which can not be
+// converted is reported and the other files are converted anyway.
+//
+// With --frames the input may have many images one after another (separated by
+// whitespaces or not), every one is converted as it is read, so a live stream is
+// converted frame by frame. With --delta the first image (and an image of another
+// size) is written after an escape which clears the terminal, of the next images
+// only rows which differ from the previous image are written, each after an escape
+// which moves the cursor to it. The current and the previous image are kept then.
+//
+// With --daemon the program serves requests on a Unix socket (in linux only), see
+// serve_connection for the protocol. A request has a path of an image or the image
+// itself, the char set, gamma and the size of the downscaled image. The outputs are
+// kept in a cache of --cache MB (64 by default) keyed by a hash of the image and
+// the options, when it is full, the least recently used outputs are dropped. A
+// repeated request costs the hash and a copy of the output. The hash is SipHash
+// with a random key of the daemon, so a client can not make an image which takes
+// the place of another one in the cache.
+//
+// Compiled with -DPGMTOASCII_LIBRARY the program has no main and it is a library
+// with the API of pgmtoascii.h, images in memory are converted with a context
+// which keeps the table of characters and the buffers for the next conversions.
+// The library leaves out the files, streams, batch and daemon, and every function
+// but the API is static, so it can be linked to a program with names of its own.
+//
 // Header file of pgm contains the following definitions:
-//     P2                   - PGM file marker
+//     P2                   - PGM file marker (P5 for binary raster)
 //     x y                  - resolution of the image
 //     n                    - number of gray levels
 //
 // Usage:
-//      ./pgmtoascii [input file] [output file] [character set]
+//      ./pgmtoascii [--threads N] [--gamma G] [--cols N] [--rows N] [input file]
+//                   [output file] [character set]
+//      ./pgmtoascii --frames|--delta [options] [input file] [output file]
+//                   [character set]
+//      ./pgmtoascii --batch [options] [manifest or directory] [output directory or -]
+//                   [character set]
+//      ./pgmtoascii --daemon [--cache MB] [socket path]
 //
 // Usage example:
 //      ./pgmtoascii input.pgm output.txt " .-+=o*O#@"
+//      cat input.pgm | ./pgmtoascii - - " .-+=o*O#@"
+//      ./pgmtoascii --threads 4 input.pgm output.txt " .-+=o*O#@"
+//      ./pgmtoascii --gamma 2.2 photo.pgm output.txt " .:-=+*#%@"
+//      ./pgmtoascii --cols 120 photo.pgm - " .:-=+*#%@"
+//      ./pgmtoascii --batch --cols 120 frames/ ascii/ " .:-=+*#%@"
+//      ./pgmtoascii --batch nightly.list - " .:-=+*#%@"
+//      camera | ./pgmtoascii --delta --cols 80 - - " .:-=+*#%@"
+//      ./pgmtoascii --daemon --cache 256 /run/pgmtoascii.sock
 //
 // Example of input:
 //      P2
@@ -116,9 +204,26 @@
 #include <stdbool.h>
 
 #ifdef linux
+#include <errno.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
+// io_uring is used by raw system calls, it needs only the kernel headers
+#if defined(__has_include) && !defined(NO_IO_URING) && !defined(PGMTOASCII_LIBRARY)
+#if __has_include(<linux/io_uring.h>)
+#define IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+// Defined by linux/fs.h, the name is used for SIMD blocks
+#undef BLOCK_SIZE
+#endif
+#endif
 #endif
 
 #ifdef _WIN32
@@ -126,15 +231,70 @@
 #include <tchar.h>
 #endif
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "pgmtoascii.h"
+
 #define P2_MARKER "P2"
+#define P5_MARKER "P5"
 
 #define ARG_COUNT 4
+#define ARG_THREADS "--threads"
+#define ARG_GAMMA "--gamma"
+#define ARG_COLS "--cols"
+#define ARG_ROWS "--rows"
+#define ARG_BATCH "--batch"
+#define ARG_FRAMES "--frames"
+#define ARG_DELTA "--delta"
+#define ARG_DAEMON "--daemon"
+#define ARG_CACHE "--cache"
 #define ARG_COMMAND 0
 #define ARG_INPUT 1
 #define ARG_OUTPUT 2
 #define ARG_CHAR_SET 3
 
-#define MAX_LEN_SIZE 70
+// Size of the chunks in which the input is read, the output of a chunk is at most
+// two times larger (every digit can be a pixel followed by a new line)
+#define CHUNK_SIZE (1 << 16)
+// A row of the downscaled image (at most as wide as the image) may end in any chunk
+#define CHUNK_OUTPUT_SIZE (2 * CHUNK_SIZE + UINT16_MAX + 1)
+// Bytes of the raster converted by one thread at a time
+#define THREAD_CHUNK_SIZE (1 << 20)
+// Requests of the daemon, see serve_connection
+#define REQUEST_BUFFER_SIZE (1 << 16)
+#define REQUEST_LINE_MAX 256
+#define REQUEST_MAX_SIZE ((size_t)1 << 28)
+// Memory of the buffers of all clients of the daemon and the number of clients
+// served at a time, the next client waits until one of them leaves
+#define REQUEST_MEMORY_MAX ((size_t)1 << 30)
+#define CONNECTION_MAX 64
+#define REQUEST_PATH "PATH"
+#define REQUEST_DATA "DATA"
+#define CACHE_SIZE_DEFAULT 64
+#define CACHE_BUCKETS_MIN 64
+#define MAX_THREADS 256
+// At most one character for every gray level
+#define CHAR_SET_MAX_LENGTH (UINT16_MAX + 1)
+// Characters are about twice as high as wide, so a downscaled image has half as many
+// rows as columns for a square
+#define CHAR_ASPECT 2.0
+
+// Path which means standard input or output
+#define PATH_STD "-"
+#define EXTENSION_INPUT ".pgm"
+#define EXTENSION_OUTPUT ".txt"
+#ifdef linux
+#define PATH_SEPARATOR "/"
+#endif
+#ifdef _WIN32
+#define PATH_SEPARATOR "\\"
+#endif
 
 #define SYMBOL_COMMENT "#"
 #define SYMBOL_SPACE " "
@@ -147,11 +307,19 @@
 #define SYMBOL_NEW_LINE_LEN 2
 #endif
 
+// Escapes of the terminal for --delta, clear the screen and move the cursor to a row
+#define ESCAPE_CLEAR "\x1b[H\x1b[2J"
+#define ESCAPE_MOVE "\x1b[%d;1H"
+#define ESCAPE_MAX_LENGTH 16
+
 #define char_is_newline(c) ((c) == '\n' || (c) == '\r')
 #define char_is_comment(c) ((c) == '#')
 #define char_is_space(c) ((c) == ' ' || (c) == '\t' || (c) == '\v' || (c) == '\f')
+#define char_is_digit(c) ((c) >= '0' && (c) <= '9')
+#define char_is_whitespace(c) (char_is_space(c) || char_is_newline(c))
 
-#define is_marrker_correct(marker) (strcmp(marker, P2_MARKER) == 0)
+#define is_marrker_correct(marker) (strncmp(marker, P2_MARKER, strlen(P2_MARKER)) == 0)
+#define is_binary_marker(marker) (strncmp(marker, P5_MARKER, strlen(P5_MARKER)) == 0)
 
 #ifdef linux
 #define error(message) \
@@ -172,18 +340,30 @@
 
 typedef unsigned short uint16_t;
 
+// File mapped to memory
 typedef struct
 {
     char *data;
     size_t size;
+#ifdef linux
+    int fd;
+#endif
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
 } file;
 
 typedef struct
 {
-    char *marker;
+    const char *marker;
+    // P5, the raster is one byte per pixel, or two bytes (big endian) if n > 255
+    bool binary;
     int x;
     uint16_t y;
     uint16_t n;
+    // Number of bytes of the header, the raster starts right after it
+    size_t size;
 } pgm_header;
 
 typedef struct
@@ -192,84 +372,338 @@ typedef struct
     file file;
 } pgm;
 
-// If usage of the program is wrong, print the correct usage and exit
-void usage_is_wrong(char *program_name)
+// Options of the conversion given on the command line
+typedef struct
 {
-    errorf("Usage: %s [input file] [output file] [character set] \n", program_name);
-}
+    char *char_set;
+    // Exponent of the curve from gray levels to the char set, 1 is linear
+    double gamma;
+    int threads;
+    // Size of the downscaled image, 0 means computed from the other one, or the size
+    // of the image if both are 0
+    int cols;
+    int rows;
+    // The input is a manifest or a directory of files
+    bool batch;
+    // The input has many images, with 'delta' only rows which differ from the
+    // previous image are written
+    bool frames;
+    bool delta;
+    // Serve requests on a socket with a cache of 'cache_size' bytes
+    bool serve;
+    size_t cache_size;
+} options;
+
+// Box filter of the image to 'cols' x 'rows' characters. Gray levels of every
+// column of the image are summed over a band of rows, at the end of the band the
+// sums are summed over the columns of every character.
+typedef struct
+{
+    int cols;
+    int rows;
+    uint32_t *sums;
+    // Row of the image and band of rows of the current character row
+    int row;
+    int band;
+} scaler;
+
+// State of the conversion of a raster which is read in chunks
+typedef struct
+{
+    pgm_header *header;
+    // Character of every gray level
+    char *table;
+    // Characters of the gray levels for SIMD lookup if there are at most 16 of them
+    unsigned char small_table[16];
+    // The last chunk ended inside a number or a comment (or inside a two byte
+    // pixel of a binary raster, 'value' is its first byte)
+    bool in_number;
+    bool in_comment;
+    uint32_t value;
+    // Every digit is a pixel, known after the first number of the raster. Until
+    // then 'value' is its last digit and 'digits' the count of its digits, the
+    // ones before the last are zeros.
+    bool packed;
+    bool packed_known;
+    uint32_t digits;
+    // Pixels of the current row and of the whole image converted so far
+    int column;
+    uint64_t pixels;
+    pgm_status status;
+    // Not NULL if the image is downscaled
+    scaler *scale;
+} converter;
+
+// Part of the raster converted by one thread, the pixel index at its start is
+// known before the conversion, so the output is written right to its place
+typedef struct
+{
+    converter c;
+    const char *data;
+    size_t size;
+    char *output;
+    size_t written;
+    // Bytes of 'data' used by the conversion
+    size_t used;
+    // Pixels found by count_part, the raster contains a comment
+    uint64_t pixels;
+    bool has_comment;
+} part;
+
+#ifdef linux
+typedef pthread_t worker;
+#define WORKER_RESULT void *
+#endif
+#ifdef _WIN32
+typedef HANDLE worker;
+#define WORKER_RESULT DWORD WINAPI
+#endif
 
-// If file marker is wrong, print the correct marker and exit
-void file_marker_is_wrong(char *marker)
+#ifndef PGMTOASCII_LIBRARY
+// Read or write of the I/O engine. A write is done when all 'size' bytes are
+// written, a read when some bytes are read (so frames of a live stream are not
+// delayed until a whole chunk arrives), nothing is read at the end of the input.
+typedef struct
 {
-    errorf("The marker of the input file is not correct. It should be %s \n", marker);
-}
+    FILE *file;
+    char *buffer;
+    size_t size;
+    size_t done;
+    bool write;
+    bool pending;
+    pgm_status status;
+#ifdef linux
+    // Thread doing the requests if there is no io_uring
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool quit;
+#endif
+} io_request;
+
+// Reads of the input and writes of the output in the background, at most one read
+// and one write are in flight
+typedef struct
+{
+    io_request read;
+    io_request write;
+#ifdef IO_URING
+    bool uring;
+    int ring;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+#endif
+} io_engine;
 
-// If the number of gray levels is wrong, print the correct number and exit
-void char_set_is_wrong(uint16_t n)
+// Buffers of the conversion of a stream, two of each, so one chunk is converted
+// while the next one is read and the previous one is written
+typedef struct
 {
-    errorf(
-        "The length of char ser is not correct with input file. It should be %d \n",
-        n);
-}
+    char *chunk[2];
+    char *output[2];
+    // Header which continues in the next chunk is joined here
+    char *header;
+    io_engine io;
+    FILE *input;
+    // Chunk being converted (chunk[k]), its size and the position in it, 'last' is
+    // set at the end of the input
+    int k;
+    size_t size;
+    size_t pos;
+    bool last;
+    // Output buffer of the next conversion, the other one may be being written
+    int o;
+    // The current and the previous frame of --delta, the rows which differ are
+    // written from 'delta'. 'cols' is 0 if there is no previous frame.
+    char *frame[2];
+    char *delta;
+    size_t frame_capacity;
+    int cols;
+    int rows;
+} stream;
+#endif
+
+// Context of the library, it has everything a conversion needs, so the conversion
+// allocates nothing
+struct pgm_context
+{
+    options opt;
+    // Table of the gray levels of the last image, 'table_n' is 0 before the first one
+    uint16_t table_n;
+    char table[UINT16_MAX + 1];
+    // Sums of the widest image, 'scale.sums' is NULL if the image is not downscaled
+    scaler scale;
+};
+
+#ifndef PGMTOASCII_LIBRARY
+// Input and output file of the batch
+typedef struct
+{
+    char *input;
+    char *output;
+} batch_file;
+
+// Files of the batch are taken one by one by the workers
+typedef struct
+{
+    options *opt;
+    batch_file *files;
+    int count;
+    int capacity;
+    int next;
+    int failed;
+} batch;
+
+#ifdef linux
+// Converted image of the daemon cache, the key is the hash of the input and of the
+// options, the options are compared too
+typedef struct cache_entry
+{
+    uint64_t hash[2];
+    size_t input_size;
+    char *char_set;
+    double gamma;
+    int cols;
+    int rows;
+    char *output;
+    size_t output_size;
+    // Entries used before and after this one, and the next entry of the bucket
+    struct cache_entry *older;
+    struct cache_entry *newer;
+    struct cache_entry *next;
+} cache_entry;
+
+// LRU cache of the daemon shared by all connections. When the memory of the
+// entries is over 'budget', the least recently used entries are dropped.
+typedef struct
+{
+    cache_entry **buckets;
+    size_t bucket_count;
+    size_t count;
+    cache_entry *newest;
+    cache_entry *oldest;
+    size_t memory;
+    size_t budget;
+    // Random key of the hashes, so clients can not guess them
+    uint64_t key[2];
+    pthread_mutex_t lock;
+} cache;
+
+// State of the daemon shared by all clients, 'memory' is the capacity of the
+// buffers of the clients
+typedef struct
+{
+    cache cache;
+    pthread_mutex_t lock;
+    pthread_cond_t left;
+    int connections;
+    size_t memory;
+} server;
+
+// Client of the daemon, its buffers are reused for all of its requests
+typedef struct
+{
+    int fd;
+    server *server;
+    // Received bytes which were not used yet are in[start, end)
+    char in[REQUEST_BUFFER_SIZE];
+    size_t start;
+    size_t end;
+    char *char_set;
+    char *data;
+    size_t data_capacity;
+    char *image;
+    size_t image_capacity;
+    char *output;
+    size_t output_capacity;
+    size_t output_size;
+} connection;
+#endif
+#endif
 
-// Access to charset is over scale
-void over_scale_charset()
+#ifndef PGMTOASCII_LIBRARY
+// If usage of the program is wrong, print the correct usage and exit
+static void usage_is_wrong(char *program_name)
 {
-    error("Access to charset is over scale\n");
+    errorf("Usage: %s [--threads N] [--gamma G] [--cols N] [--rows N] [input file] "
+           "[output file] [character set] \n"
+           "       %s --frames|--delta [options] [input file] [output file] [character set] \n"
+           "       %s --batch [options] [manifest or directory] [output directory or -] "
+           "[character set] \n"
+           "       %s --daemon [--cache MB] [socket path] \n",
+           program_name, program_name, program_name, program_name);
 }
 
-// Count char set of input
-size_t count_char_set_input(char *char_set)
+// If the char set is empty or too long, print it and exit
+static void char_set_is_wrong()
 {
-    return strlen(char_set);
+    errorf("The char set must contain 1 to %d characters \n", CHAR_SET_MAX_LENGTH);
 }
+#endif
 
-bool is_charset_length_correct(uint16_t n, char *char_set)
+// Count char set of input
+static size_t count_char_set_input(char *char_set)
 {
-    return n + 1 == count_char_set_input(char_set);
+    return strlen(char_set);
 }
 
-double length_of_number(uint16_t number)
+// Any number of gray levels is mapped to the char set, it must not be empty
+static bool is_charset_length_correct(char *char_set)
 {
-    return floor(log10(number)) + 1;
+    size_t length = count_char_set_input(char_set);
+    return length > 0 && length <= CHAR_SET_MAX_LENGTH;
 }
 
-file read_file(char *input_file)
+#ifndef PGMTOASCII_LIBRARY
+// Map the input file to memory, the data are not copied
+static file read_file(char *input_file)
 {
     file file;
 
 #ifdef linux
     // Open the file
-    int fd = open(input_file, O_RDONLY);
+    file.fd = open(input_file, O_RDONLY);
+    if (file.fd < 0)
+    {
+        errorf("Unable to open: %s\n", input_file);
+    }
 
     // Get the size of the file
-    size_t size = lseek(fd, 0, SEEK_END);
-
-    // Map file to memory
-    char *buffer = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (buffer == MAP_FAILED)
+    struct stat info;
+    if (fstat(file.fd, &info) != 0)
     {
-        error("Error: Could not map file to memory \n");
+        errorf("Unable to open: %s\n", input_file);
     }
+    file.size = info.st_size;
 
-    // Copy the file to a char array
-    char *data = malloc(size * sizeof(char));
-    if (data == NULL)
+    // Map file to memory, an empty file can not be mapped
+    file.data = NULL;
+    if (file.size > 0)
     {
-        error("Error: Could not allocate memory \n");
+        file.data = mmap(NULL, file.size, PROT_READ, MAP_PRIVATE, file.fd, 0);
+        if (file.data == MAP_FAILED)
+        {
+            error("Error: Could not map file to memory \n");
+        }
+        madvise(file.data, file.size, MADV_SEQUENTIAL);
     }
-
-    memcpy(data, buffer, size);
-
-    // Close the file
-    munmap(buffer, size);
-    close(fd);
 #endif
 #ifdef _WIN32
     TCHAR *inputFile = _T(input_file);
 
     // Open the file for read
-    HANDLE hFile = CreateFile(
+    file.file = CreateFile(
         inputFile,
         GENERIC_READ,
         FILE_SHARE_READ,
@@ -277,57 +711,183 @@ file read_file(char *input_file)
         OPEN_EXISTING,
         FILE_ATTRIBUTE_NORMAL,
         NULL);
-    if (hFile == INVALID_HANDLE_VALUE)
+    if (file.file == INVALID_HANDLE_VALUE)
     {
         errorf("Unable to open: %s\n", inputFile);
     }
 
     // Get the file size
-    DWORD dwFileSize = GetFileSize(hFile, NULL);
+    LARGE_INTEGER fileSize;
+    GetFileSizeEx(file.file, &fileSize);
+    file.size = fileSize.QuadPart;
+
+    // Create a file mapping object, an empty file can not be mapped
+    file.data = NULL;
+    file.mapping = NULL;
+    if (file.size > 0)
+    {
+        file.mapping = CreateFileMapping(file.file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (file.mapping == NULL)
+        {
+            CloseHandle(file.file);
+            errorf("Unable to create file mapping for file: %s\n", inputFile);
+        }
+        file.data = MapViewOfFile(file.mapping, FILE_MAP_READ, 0, 0, file.size);
+        if (file.data == NULL)
+        {
+            CloseHandle(file.mapping);
+            CloseHandle(file.file);
+            errorf("Unable to map view of file: %s\n", inputFile);
+        }
+    }
+#endif
 
-    // Create a file mapping object
-    HANDLE hFileMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
-    if (hFileMapping == NULL)
+    return file;
+}
+#endif
+
+// Reason of the failure of the conversion
+const char *pgm_status_message(pgm_status status)
+{
+    switch (status)
     {
-        CloseHandle(hFile);
-        errorf("Unable to create file mapping for file: %s\n", inputFile);
+    case PGM_ERROR_MARKER:
+        return "The marker of the input file is not correct. It should be " P2_MARKER
+               " or " P5_MARKER " \n";
+    case PGM_ERROR_OVER_SCALE:
+        return "Access to charset is over scale\n";
+    case PGM_INCOMPLETE:
+    case PGM_ERROR_HEADER:
+        return "Error: The header of the input file is not correct \n";
+    case PGM_ERROR_TRUNCATED:
+        return "Error: The input file has less pixels than its header says \n";
+    case PGM_ERROR_OPEN:
+        return "Error: Could not open the file \n";
+    case PGM_ERROR_READ:
+        return "Error: Could not read the input file \n";
+    case PGM_ERROR_WRITE:
+        return "Error: Could not write the output file \n";
+    case PGM_ERROR_OPTIONS:
+        return "Error: The options of the conversion are not correct \n";
+    case PGM_ERROR_MEMORY:
+        return "Error: Could not allocate memory \n";
+    case PGM_ERROR_OUTPUT_SIZE:
+        return "Error: The output buffer is too small \n";
+    case PGM_ERROR_LEFTOVER:
+        return "Error: The input file has more pixels than its header says \n";
+    default:
+        return "Error: The input file contains invalid characters \n";
     }
-    LPVOID lpFileBase = MapViewOfFile(hFileMapping, FILE_MAP_READ, 0, 0, dwFileSize);
-    if (lpFileBase == NULL)
+}
+
+#ifndef PGMTOASCII_LIBRARY
+// If the input is not a valid pgm file, print the reason and exit
+static void pgm_status_is_wrong(pgm_status status)
+{
+    errorf("%s", pgm_status_message(status));
+}
+#endif
+
+// Skip whitespaces and comments from 'pos', returns false if the data end before
+static bool skip_header_space(const char *data, size_t size, size_t *pos)
+{
+    while (*pos < size)
     {
-        CloseHandle(hFileMapping);
-        CloseHandle(hFile);
-        errorf("Unable to map view of file: %s\n", inputFile);
+        char c = data[*pos];
+        if (char_is_comment(c))
+        {
+            while (*pos < size && !char_is_newline(data[*pos]))
+            {
+                (*pos)++;
+            }
+        }
+        else if (!char_is_whitespace(c))
+        {
+            return true;
+        }
+        else
+        {
+            (*pos)++;
+        }
     }
+    return false;
+}
 
-    // Malloc buffer
-    char *data = malloc(dwFileSize * sizeof(char));
-    if (data == NULL)
+// Read number of the header from 'pos'
+static pgm_status read_header_number(const char *data, size_t size, size_t *pos, uint32_t *value)
+{
+    if (!skip_header_space(data, size, pos))
+    {
+        return PGM_INCOMPLETE;
+    }
+    if (!char_is_digit(data[*pos]))
     {
-        UnmapViewOfFile(lpFileBase);
-        CloseHandle(hFileMapping);
-        CloseHandle(hFile);
-        errorf("Unable to allocate memory for file: %s\n", inputFile);
+        return PGM_ERROR_HEADER;
     }
-    int size = dwFileSize;
 
-    // Copy file to a char array
-    memcpy(data, lpFileBase, size);
+    *value = 0;
+    while (*pos < size && char_is_digit(data[*pos]))
+    {
+        *value = *value * 10 + (data[*pos] - '0');
+        if (*value > UINT16_MAX)
+        {
+            return PGM_ERROR_HEADER;
+        }
+        (*pos)++;
+    }
 
-    // Close file
-    UnmapViewOfFile(lpFileBase);
-    CloseHandle(hFileMapping);
-    CloseHandle(hFile);
-#endif
+    // The number may continue in data which were not read yet
+    return *pos < size ? PGM_OK : PGM_INCOMPLETE;
+}
 
-    file.data = data;
-    file.size = size;
+// Parse the header at the start of 'data' in place. 'header->size' is set to the
+// number of bytes of the header. Returns PGM_INCOMPLETE if 'data' end before the
+// header does.
+static pgm_status parse_pgm_header(const char *data, size_t size, pgm_header *header)
+{
+    size_t marker_length = strlen(P2_MARKER);
+    if (size < marker_length + 1)
+    {
+        return PGM_INCOMPLETE;
+    }
+    if ((!is_marrker_correct(data) && !is_binary_marker(data)) ||
+        !char_is_whitespace(data[marker_length]))
+    {
+        return PGM_ERROR_MARKER;
+    }
+    header->binary = is_binary_marker(data);
+    header->marker = header->binary ? P5_MARKER : P2_MARKER;
+
+    size_t pos = marker_length;
+    uint32_t x, y, n;
+    pgm_status status;
+    if ((status = read_header_number(data, size, &pos, &x)) != PGM_OK ||
+        (status = read_header_number(data, size, &pos, &y)) != PGM_OK ||
+        (status = read_header_number(data, size, &pos, &n)) != PGM_OK)
+    {
+        return status;
+    }
+    if (x == 0 || y == 0 || n == 0)
+    {
+        return PGM_ERROR_HEADER;
+    }
+    // The binary raster may start with any byte, so the whitespace is required
+    if (header->binary && !char_is_whitespace(data[pos]))
+    {
+        return PGM_ERROR_HEADER;
+    }
 
-    return file;
+    header->x = x;
+    header->y = y;
+    header->n = n;
+    // Exactly one whitespace separates the header from the raster
+    header->size = pos + 1;
+    return PGM_OK;
 }
 
+#ifndef PGMTOASCII_LIBRARY
 // Read the header of the pgm file
-pgm_header *read_pgm_header(file input_file)
+static pgm_header *read_pgm_header(file input_file)
 {
     pgm_header *header = (pgm_header *)malloc(sizeof(pgm_header));
     if (header == NULL)
@@ -335,31 +895,16 @@ pgm_header *read_pgm_header(file input_file)
         error("Error: Could not allocate memory for header \n");
     }
 
-    // read the marker
-    char *marker = strtok(strdup(input_file.data), SYMBOL_NEW_LINE);
-
-    // check if the marker is correct
-    if (marker == NULL || !is_marrker_correct(marker))
-        file_marker_is_wrong(P2_MARKER);
-    else
-        header->marker = marker;
-
-    // read the x
-    char *x = strtok(NULL, SYMBOL_SPACE);
-    (*header).x = atoi(x);
-
-    // read the y
-    char *y = strtok(NULL, SYMBOL_NEW_LINE);
-    (*header).y = atoi(y);
-
-    // read the n
-    char *n = strtok(NULL, SYMBOL_NEW_LINE);
-    (*header).n = atoi(n);
+    pgm_status status = parse_pgm_header(input_file.data, input_file.size, header);
+    if (status != PGM_OK)
+    {
+        pgm_status_is_wrong(status);
+    }
 
     return header;
 }
 
-pgm read_pgm(char *input_file_path)
+static pgm read_pgm(char *input_file_path)
 {
     file input_file = read_file(input_file_path);
 
@@ -377,32 +922,38 @@ pgm read_pgm(char *input_file_path)
     return pgm;
 }
 
-void write_file(char *output_file, char *data, size_t size)
+// Create the output file of 'size' bytes mapped to memory, the conversion writes
+// right to it
+static file create_file(char *output_file, size_t size)
 {
+    file file;
+    file.size = size;
+
 #ifdef linux
     // Create the file
-    int fd = open(output_file, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    file.fd = open(output_file, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (file.fd < 0)
+    {
+        errorf("Unable to create file: %s\n", output_file);
+    }
 
-    // Set the size of the file
-    ftruncate(fd, size);
+    // Set the size of the file, the blocks are allocated at once, not on the first
+    // write to every page
+    if (posix_fallocate(file.fd, 0, size) != 0 && ftruncate(file.fd, size) != 0)
+    {
+        error("Error: Could not write the output file \n");
+    }
 
     // Map file to memory
-    char *buffer = mmap(NULL, size, PROT_WRITE, MAP_SHARED, fd, 0);
-    if (buffer == MAP_FAILED)
+    file.data = mmap(NULL, size, PROT_WRITE, MAP_SHARED | MAP_POPULATE, file.fd, 0);
+    if (file.data == MAP_FAILED)
     {
         error("Error: Could not map file to memory \n");
     }
-
-    // Write to the file
-    strcpy(buffer, data);
-
-    // Unmap the file
-    munmap(buffer, size);
-    close(fd);
 #endif
 #ifdef _WIN32
     // Create the file
-    HANDLE hFile = CreateFile(
+    file.file = CreateFile(
         output_file,
         GENERIC_READ | GENERIC_WRITE,
         FILE_SHARE_READ,
@@ -410,176 +961,3033 @@ void write_file(char *output_file, char *data, size_t size)
         CREATE_ALWAYS,
         0,
         NULL);
-    if (hFile == INVALID_HANDLE_VALUE)
+    if (file.file == INVALID_HANDLE_VALUE)
     {
         errorf("Unable to create file: %s\n", output_file);
     }
 
-    // Create a file mapping object
-    HANDLE hFileMapping = CreateFileMapping(hFile, NULL, PAGE_READWRITE, 0, size, NULL);
-    if (hFileMapping == NULL)
+    // Create a file mapping object of the size of the output
+    LARGE_INTEGER fileSize;
+    fileSize.QuadPart = size;
+    file.mapping = CreateFileMapping(file.file, NULL, PAGE_READWRITE, fileSize.HighPart,
+                                     fileSize.LowPart, NULL);
+    if (file.mapping == NULL)
     {
-        CloseHandle(hFile);
+        CloseHandle(file.file);
         errorf("Unable to create file mapping for file: %s\n", output_file);
     }
 
     // Map the file
-    LPVOID lpFileBase = MapViewOfFile(hFileMapping, FILE_MAP_WRITE, 0, 0, size);
-    if (lpFileBase == NULL)
+    file.data = MapViewOfFile(file.mapping, FILE_MAP_WRITE, 0, 0, size);
+    if (file.data == NULL)
     {
-        CloseHandle(hFileMapping);
-        CloseHandle(hFile);
+        CloseHandle(file.mapping);
+        CloseHandle(file.file);
         errorf("Unable to map view of file: %s\n", output_file);
     }
+#endif
 
-    // Copy data to file
-    memcpy(lpFileBase, data, size);
+    return file;
+}
 
-    // Close file
-    UnmapViewOfFile(lpFileBase);
-    CloseHandle(hFileMapping);
-    CloseHandle(hFile);
+// Unmap and close the file, an output file is cut to 'size' bytes
+static void close_file(file *file, size_t size)
+{
+#ifdef linux
+    if (file->data != NULL)
+    {
+        munmap(file->data, file->size);
+    }
+    if (size != file->size && ftruncate(file->fd, size) != 0)
+    {
+        error("Error: Could not write the output file \n");
+    }
+    close(file->fd);
+#endif
+#ifdef _WIN32
+    if (file->data != NULL)
+    {
+        UnmapViewOfFile(file->data);
+        CloseHandle(file->mapping);
+    }
+    if (size != file->size)
+    {
+        LARGE_INTEGER position;
+        position.QuadPart = size;
+        SetFilePointerEx(file->file, position, NULL, FILE_BEGIN);
+        SetEndOfFile(file->file);
+    }
+    CloseHandle(file->file);
 #endif
 }
+#endif
 
-int calc_header_size(pgm_header *header)
+// Size of the output image in characters. The downscaled size is given by the
+// options, the missing one keeps the aspect ratio of the image.
+static void calc_output_dimensions(pgm_header *header, options *opt, int *cols, int *rows)
 {
-    int x = length_of_number(header->x);
-    int y = length_of_number(header->y);
-    int n = length_of_number(header->n);
+    if (opt->cols == 0 && opt->rows == 0)
+    {
+        *cols = header->x;
+        *rows = header->y;
+        return;
+    }
+
+    *cols = opt->cols;
+    *rows = opt->rows;
+    if (*rows == 0)
+    {
+        *rows = (int)((double)header->y * *cols / header->x / CHAR_ASPECT + 0.5);
+    }
+    if (*cols == 0)
+    {
+        *cols = (int)((double)header->x * *rows / header->y * CHAR_ASPECT + 0.5);
+    }
 
-    return strlen(header->marker) +
-           SYMBOL_NEW_LINE_LEN +
-           x +
-           SYMBOL_NEW_LINE_LEN +
-           y +
-           SYMBOL_NEW_LINE_LEN +
-           n +
-           SYMBOL_NEW_LINE_LEN;
+    // A character is at least one pixel
+    *cols = *cols < 1 ? 1 : (*cols > header->x ? header->x : *cols);
+    *rows = *rows < 1 ? 1 : (*rows > header->y ? header->y : *rows);
 }
 
-void convert_pgm_to_ascii(pgm pgm, char *char_set, char *output)
+// Start downscaling of an image, 'scale->sums' has at least x entries
+static void scaler_start(scaler *scale, pgm_header *header, options *opt)
 {
-    int header_size = calc_header_size(pgm.header);
-    int char_set_length = count_char_set_input(char_set);
+    calc_output_dimensions(header, opt, &scale->cols, &scale->rows);
+    memset(scale->sums, 0, header->x * sizeof(uint32_t));
+    scale->row = 0;
+    scale->band = 0;
+}
 
-    int idx = 0;
-    int idx_char_set = 0;
-    bool is_in_comment = false;
-    int idx_buffer = 0;
-    char *buffer = malloc(MAX_LEN_SIZE * sizeof(char));
-    if (buffer == NULL)
+#ifndef PGMTOASCII_LIBRARY
+// Returns NULL if the image is not downscaled
+static scaler *scaler_create(pgm_header *header, options *opt)
+{
+    if (opt->cols == 0 && opt->rows == 0)
     {
-        error("Error: Could not allocate memory for buffer \n");
+        return NULL;
     }
 
-    for (int i = header_size; i < pgm.file.size; i++)
+    scaler *scale = malloc(sizeof(scaler));
+    if (scale == NULL)
     {
-        char c = pgm.file.data[i];
-        bool is_newline = char_is_newline(c);
-        bool is_comment = char_is_comment(c);
-        bool is_space = char_is_space(c);
-
-        if (is_newline)
-        {
-            is_in_comment = false;
-            if (c == '\n')
-            {
-                output[idx] = '\n';
-                idx++;
-            }
-
-            // reset buffer
-            idx_buffer = 0;
+        error("Error: Could not allocate memory for scaler \n");
+    }
+    scale->sums = malloc(header->x * sizeof(uint32_t));
+    if (scale->sums == NULL)
+    {
+        error("Error: Could not allocate memory for scaler \n");
+    }
+    scaler_start(scale, header, opt);
+    return scale;
+}
+#endif
 
-            continue;
-        }
-        else if (is_in_comment)
-        {
-            continue;
-        }
+// Character of gray level 'value', (value / n) ^ gamma of the char set rounded to
+// the nearest character. With gamma 1 and n + 1 characters it is the value-th one.
+static char quantize_gray_level(pgm_header *header, uint32_t value, options *opt)
+{
+    size_t last = count_char_set_input(opt->char_set) - 1;
+    size_t index;
+    if (opt->gamma == 1.0)
+    {
+        index = ((uint64_t)value * last + header->n / 2) / header->n;
+    }
+    else
+    {
+        index = (size_t)(pow((double)value / header->n, opt->gamma) * last + 0.5);
+    }
+    return opt->char_set[index];
+}
 
-        if (is_comment)
-        {
-            is_in_comment = true;
-            continue;
-        }
-        else if (is_space)
-        {
-            idx_char_set = 0;
-            int err = sscanf(buffer, "%d", &idx_char_set);
-            if (err == 0)
-            {
-                error("Error: Could not convert buffer to int \n");
-            }
+// Character of every gray level of the image to 'table' of n + 1 bytes, so the
+// conversion only looks up the character of every pixel
+static void fill_table(char *table, pgm_header *header, options *opt)
+{
+    for (uint32_t value = 0; value <= header->n; value++)
+    {
+        table[value] = quantize_gray_level(header, value, opt);
+    }
+}
 
-            if (idx_char_set >= char_set_length)
-                over_scale_charset();
+// Start conversion of an image with the table of its gray levels and the scaler
+// (NULL if the image is not downscaled), the caller owns both of them
+static void converter_start(converter *c, pgm_header *header, char *table, scaler *scale)
+{
+    c->header = header;
+    c->table = table;
+    memset(c->small_table, 0, sizeof(c->small_table));
+    size_t small_count = (size_t)header->n + 1;
+    memcpy(c->small_table, c->table,
+           small_count < sizeof(c->small_table) ? small_count : sizeof(c->small_table));
+    c->scale = scale;
+    c->in_number = false;
+    c->in_comment = false;
+    c->value = 0;
+    c->packed = false;
+    c->packed_known = header->binary || header->n >= 10;
+    c->digits = 0;
+    c->column = 0;
+    c->pixels = 0;
+    c->status = PGM_OK;
+}
 
-            char char_to_set = char_set[idx_char_set];
-            err = sscanf(&char_to_set, "%c", &output[idx]);
-            if (err == 0)
-            {
-                error("Error: Could not convert char to char \n");
-            }
+#ifndef PGMTOASCII_LIBRARY
+// Start conversion of an image with a table and a scaler of its own, they are freed
+// by converter_free
+static void converter_init(converter *c, pgm_header *header, options *opt)
+{
+    char *table = malloc((size_t)header->n + 1);
+    if (table == NULL)
+    {
+        error("Error: Could not allocate memory for table \n");
+    }
+    fill_table(table, header, opt);
+    converter_start(c, header, table, scaler_create(header, opt));
+}
 
-            idx++;
-            idx_buffer = 0;
-        }
-        else
-        {
-            buffer[idx_buffer] = c;
-            idx_buffer++;
-        }
+static void converter_free(converter *c)
+{
+    free(c->table);
+    if (c->scale != NULL)
+    {
+        free(c->scale->sums);
+        free(c->scale);
     }
 }
+#endif
 
-int main(int argc, char *argv[])
+static uint64_t converter_total_pixels(converter *c)
 {
-#if STD_OUT
-    char *arg_input_file_path = "input.pgm";
-    char *arg_output_file_path = "output.txt";
-    char *arg_char_set = " .-+=o*O#@";
-#else
-    // check if the number of arguments is correct
-    if (argc != ARG_COUNT)
-        usage_is_wrong(argv[ARG_COMMAND]);
+    return (uint64_t)c->header->x * c->header->y;
+}
 
-    // args
-    char *arg_input_file_path = argv[ARG_INPUT];
-    char *arg_output_file_path = argv[ARG_OUTPUT];
-    char *arg_char_set = argv[ARG_CHAR_SET];
-#endif
+// Bytes of one pixel of the binary raster
+static size_t pixel_size(pgm_header *header)
+{
+    return header->n > UINT8_MAX ? 2 : 1;
+}
 
-    // read the pgm file
-    pgm pgm = read_pgm(arg_input_file_path);
+// Highest gray level of the image, higher values are over scale
+static uint32_t converter_limit(converter *c)
+{
+    return c->header->n;
+}
 
-    // check char set length
-    if (!is_charset_length_correct(pgm.header->n, arg_char_set))
+// End of a row of the image, if it is the last row of a band, write the averages of
+// the characters of the band and a new line. Returns number of written bytes.
+static size_t scale_row(converter *c, char *output)
+{
+    scaler *scale = c->scale;
+    int x = c->header->x;
+    int y = c->header->y;
+    int band_end = (int)((int64_t)(scale->band + 1) * y / scale->rows);
+    if (++scale->row < band_end)
     {
-        char_set_is_wrong(pgm.header->n);
+        return 0;
     }
 
-    // prepare the output buffer
-    size_t output_buffer_size = (pgm.header->x * pgm.header->y - 2) * sizeof(char);
-    char *output_buffer = malloc(output_buffer_size);
+    int band_rows = band_end - (int)((int64_t)scale->band * y / scale->rows);
+    int start = 0;
+    for (int col = 0; col < scale->cols; col++)
+    {
+        int end = (int)((int64_t)(col + 1) * x / scale->cols);
+        uint64_t sum = 0;
+        for (int i = start; i < end; i++)
+        {
+            sum += scale->sums[i];
+        }
+        uint64_t count = (uint64_t)(end - start) * band_rows;
+        output[col] = c->table[(sum + count / 2) / count];
+        start = end;
+    }
+    output[scale->cols] = '\n';
 
+    memset(scale->sums, 0, x * sizeof(uint32_t));
+    scale->band++;
+    return scale->cols + 1;
+}
+
+// Add pixel to the sum of its column of the downscaled image. It is not inlined, so
+// convert_pixel stays small enough to be inlined into the loops over the raster.
+static __attribute__((noinline)) size_t scale_pixel(converter *c, uint32_t value, char *output)
+{
+    c->scale->sums[c->column] += value;
+    c->pixels++;
+    if (++c->column < c->header->x)
+    {
+        return 0;
+    }
+
+    c->column = 0;
+    return scale_row(c, output);
+}
+
+// Write character of the pixel and a new line after the last pixel of the row
+static size_t convert_pixel(converter *c, uint32_t value, char *output)
+{
+    if (__builtin_expect(c->scale != NULL, 0))
+    {
+        return scale_pixel(c, value, output);
+    }
+
+    output[0] = c->table[value];
+    c->pixels++;
+    if (++c->column < c->header->x)
+    {
+        return 1;
+    }
+
+    c->column = 0;
+    output[1] = '\n';
+    return 2;
+}
+
+// Convert 'data' byte by byte, see convert_chunk
+static size_t convert_scalar(converter *c, const char *data, size_t size, char *output,
+                             size_t *written)
+{
+    uint64_t total = converter_total_pixels(c);
+    size_t out = 0;
+    size_t i = 0;
+
+    for (; i < size && c->pixels < total; i++)
+    {
+        char ch = data[i];
+
+        if (c->in_comment)
+        {
+            c->in_comment = !char_is_newline(ch);
+            continue;
+        }
+
+        if (char_is_digit(ch))
+        {
+            uint32_t digit = ch - '0';
+            // The next digit of the first number, the number is packed if it would be
+            // over scale or as long as a row, then its digits so far are pixels too
+            if (!c->packed_known && c->in_number)
+            {
+                if (c->value == 0 && c->digits + 1 < (uint32_t)c->header->x)
+                {
+                    c->value = digit;
+                    c->digits++;
+                    if (c->value > c->header->n)
+                    {
+                        c->status = PGM_ERROR_OVER_SCALE;
+                        break;
+                    }
+                    continue;
+                }
+
+                c->packed = true;
+                c->packed_known = true;
+                c->in_number = false;
+                for (uint32_t zero = 1; zero < c->digits && c->pixels < total; zero++)
+                {
+                    out += convert_pixel(c, 0, output + out);
+                }
+                if (c->pixels < total)
+                {
+                    out += convert_pixel(c, c->value, output + out);
+                }
+                c->value = 0;
+                if (c->pixels == total)
+                {
+                    break;
+                }
+            }
+
+            if (c->packed)
+            {
+                if (digit > c->header->n)
+                {
+                    c->status = PGM_ERROR_OVER_SCALE;
+                    break;
+                }
+                out += convert_pixel(c, digit, output + out);
+                continue;
+            }
+
+            c->value = c->value * 10 + digit;
+            c->in_number = true;
+            c->digits = 1;
+            if (c->value > c->header->n)
+            {
+                c->status = PGM_ERROR_OVER_SCALE;
+                break;
+            }
+            continue;
+        }
+
+        if (c->in_number)
+        {
+            out += convert_pixel(c, c->value, output + out);
+            c->in_number = false;
+            c->value = 0;
+            c->packed_known = true;
+        }
+
+        if (char_is_comment(ch))
+        {
+            c->in_comment = true;
+        }
+        else if (!char_is_whitespace(ch))
+        {
+            c->status = PGM_ERROR_DATA;
+            break;
+        }
+    }
+
+    *written = out;
+    return i;
+}
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#if defined(__AVX2__)
+#define BLOCK_SIZE 32
+#else
+#define BLOCK_SIZE 16
+#endif
+typedef uint32_t block_mask;
+#define BLOCK_FULL ((block_mask)(((uint64_t)1 << BLOCK_SIZE) - 1))
+
+// Find digits and whitespaces of one block, bit i is set for byte i. 'values' are
+// set to values of the digits and 0 for other bytes.
+static void classify_block(const char *data, block_mask *digits, block_mask *spaces,
+                           unsigned char *values)
+{
+#if defined(__AVX2__)
+    __m256i v = _mm256_loadu_si256((const __m256i *)data);
+    // Bytes above 127 are negative, so they are neither
+    __m256i is_digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+                                        _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+    __m256i is_control = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('\t' - 1)),
+                                          _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), v));
+    __m256i is_space = _mm256_or_si256(is_control, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+    __m256i digit_values = _mm256_and_si256(_mm256_sub_epi8(v, _mm256_set1_epi8('0')), is_digit);
+    _mm256_storeu_si256((__m256i *)values, digit_values);
+    *digits = (block_mask)_mm256_movemask_epi8(is_digit);
+    *spaces = (block_mask)_mm256_movemask_epi8(is_space);
+#else
+    __m128i v = _mm_loadu_si128((const __m128i *)data);
+    __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                     _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+    __m128i is_control = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('\t' - 1)),
+                                       _mm_cmplt_epi8(v, _mm_set1_epi8('\r' + 1)));
+    __m128i is_space = _mm_or_si128(is_control, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+    __m128i digit_values = _mm_and_si128(_mm_sub_epi8(v, _mm_set1_epi8('0')), is_digit);
+    _mm_storeu_si128((__m128i *)values, digit_values);
+    *digits = (block_mask)_mm_movemask_epi8(is_digit);
+    *spaces = (block_mask)_mm_movemask_epi8(is_space);
+#endif
+}
+
+// Value of the digits from 'start' to 'end' appended to 'value', stops growing
+// after UINT16_MAX, such numbers are over scale anyway
+static uint32_t fold_digits(uint32_t value, const unsigned char *values, int start, int end)
+{
+    for (int i = start; i < end && value <= UINT16_MAX; i++)
+    {
+        value = value * 10 + values[i];
+    }
+    return value;
+}
+
+// Convert one block of digits and whitespaces. The numbers are found from the bit
+// mask of digits, numbers of at most three digits are computed from the digit and
+// the two before it without a loop. There must be two zero bytes before 'values'.
+static size_t convert_block(converter *c, const unsigned char *values, block_mask digits,
+                            char *output)
+{
+    uint32_t limit = converter_limit(c);
+    size_t out = 0;
+
+    // Gray levels of one digit written without spaces, every digit is a pixel
+    if (c->packed)
+    {
+        while (digits != 0)
+        {
+            uint32_t value = values[__builtin_ctz(digits)];
+            if (value > limit)
+            {
+                c->status = PGM_ERROR_OVER_SCALE;
+                return out;
+            }
+            out += convert_pixel(c, value, output + out);
+            digits &= digits - 1;
+        }
+        return out;
+    }
+
+    // The number at the start of the block may continue from the previous one
+    if (c->in_number || (digits & 1))
+    {
+        block_mask rest = ~digits & BLOCK_FULL;
+        int end = rest == 0 ? BLOCK_SIZE : __builtin_ctz(rest);
+        uint32_t value = fold_digits(c->in_number ? c->value : 0, values, 0, end);
+        if (value > limit)
+        {
+            c->status = PGM_ERROR_OVER_SCALE;
+            return out;
+        }
+        if (end == BLOCK_SIZE)
+        {
+            c->in_number = true;
+            c->value = value;
+            return out;
+        }
+
+        out += convert_pixel(c, value, output + out);
+        c->in_number = false;
+        c->value = 0;
+        digits &= BLOCK_FULL << end & BLOCK_FULL;
+    }
+
+    // The number at the end of the block may continue in the next one
+    block_mask ends = digits & ~(digits >> 1) & (BLOCK_FULL >> 1);
+    block_mask long_numbers = digits & digits >> 1 & digits >> 2 & digits >> 3;
+    while (ends != 0)
+    {
+        int end = __builtin_ctz(ends);
+        uint32_t value;
+        if (long_numbers == 0)
+        {
+            // Bytes before the number are 0 and there are two of them before the
+            // block, the third digit is used only if the second one is a digit.
+            // The number at the start of the block is done, so 'end' is at least 1.
+            uint32_t third = values[end - 2] & -((digits >> (end - 1)) & 1);
+            value = values[end] + 10 * values[end - 1] + 100 * third;
+        }
+        else
+        {
+            block_mask before = ~digits & (((block_mask)1 << end) - 1);
+            int start = before == 0 ? 0 : 32 - __builtin_clz(before);
+            value = fold_digits(0, values, start, end + 1);
+        }
+
+        if (value > limit)
+        {
+            c->status = PGM_ERROR_OVER_SCALE;
+            return out;
+        }
+        out += convert_pixel(c, value, output + out);
+        ends &= ends - 1;
+    }
+
+    if ((digits >> (BLOCK_SIZE - 1)) & 1)
+    {
+        block_mask before = ~digits & BLOCK_FULL;
+        int start = 32 - __builtin_clz(before);
+        c->in_number = true;
+        c->value = fold_digits(0, values, start, BLOCK_SIZE);
+        if (c->value > limit)
+        {
+            c->status = PGM_ERROR_OVER_SCALE;
+        }
+    }
+    return out;
+}
+#endif
+
+// Map 'count' gray levels of one byte to characters. Returns number of the mapped
+// pixels, it is smaller than 'count' only if a gray level is over scale.
+static size_t map_bytes(converter *c, const unsigned char *data, size_t count, char *output)
+{
+    uint32_t limit = converter_limit(c);
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    // Up to 16 characters fit one register, every byte selects one of them
+    if (limit < 16)
+    {
+        __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)c->small_table));
+        __m256i max = _mm256_set1_epi8(limit);
+        for (; i + 32 <= count; i += 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+            if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(v, max), max)) != -1)
+            {
+                break;
+            }
+            _mm256_storeu_si256((__m256i *)(output + i), _mm256_shuffle_epi8(table, v));
+        }
+    }
+#elif defined(__SSSE3__)
+    // Up to 16 characters fit one register, every byte selects one of them
+    if (limit < 16)
+    {
+        __m128i table = _mm_loadu_si128((const __m128i *)c->small_table);
+        __m128i max = _mm_set1_epi8(limit);
+        for (; i + 16 <= count; i += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, max), max)) != 0xFFFF)
+            {
+                break;
+            }
+            _mm_storeu_si128((__m128i *)(output + i), _mm_shuffle_epi8(table, v));
+        }
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        if (data[i] > limit)
+        {
+            break;
+        }
+        output[i] = c->table[data[i]];
+    }
+    return i;
+}
+
+// Add 'count' gray levels of one byte to the sums of their columns, starting at the
+// current column. Returns number of the added pixels, it is smaller than 'count'
+// only if a gray level is over scale.
+static size_t scale_bytes(converter *c, const unsigned char *data, size_t count)
+{
+    uint32_t limit = converter_limit(c);
+    uint32_t *sums = c->scale->sums + c->column;
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    // Bytes are widened to 32 bits and added to four sums at a time
+    __m128i max = _mm_set1_epi8(limit > UINT8_MAX ? UINT8_MAX : limit);
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, max), max)) != 0xFFFF)
+        {
+            break;
+        }
+
+        __m128i low = _mm_unpacklo_epi8(v, zero);
+        __m128i high = _mm_unpackhi_epi8(v, zero);
+        __m128i *s = (__m128i *)(sums + i);
+        _mm_storeu_si128(s, _mm_add_epi32(_mm_loadu_si128(s), _mm_unpacklo_epi16(low, zero)));
+        _mm_storeu_si128(s + 1, _mm_add_epi32(_mm_loadu_si128(s + 1), _mm_unpackhi_epi16(low, zero)));
+        _mm_storeu_si128(s + 2, _mm_add_epi32(_mm_loadu_si128(s + 2), _mm_unpacklo_epi16(high, zero)));
+        _mm_storeu_si128(s + 3, _mm_add_epi32(_mm_loadu_si128(s + 3), _mm_unpackhi_epi16(high, zero)));
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        if (data[i] > limit)
+        {
+            break;
+        }
+        sums[i] += data[i];
+    }
+    return i;
+}
+
+// Convert part of a binary raster, see convert_chunk. Pixels of one byte are
+// mapped row by row, pixels of two bytes one by one, such pixel may be split
+// between two chunks.
+static size_t convert_binary(converter *c, const char *data, size_t size, char *output,
+                             size_t *written)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint64_t total = converter_total_pixels(c);
+    size_t out = 0;
+    size_t i = 0;
+
+    if (pixel_size(c->header) == 2)
+    {
+        uint32_t limit = converter_limit(c);
+        for (; i < size && c->pixels < total; i++)
+        {
+            if (!c->in_number)
+            {
+                c->value = bytes[i];
+                c->in_number = true;
+                continue;
+            }
+
+            uint32_t value = c->value << 8 | bytes[i];
+            c->in_number = false;
+            if (value > limit)
+            {
+                c->status = PGM_ERROR_OVER_SCALE;
+                break;
+            }
+            out += convert_pixel(c, value, output + out);
+        }
+
+        *written = out;
+        return i;
+    }
+
+    while (i < size && c->pixels < total)
+    {
+        size_t row = c->header->x - c->column;
+        size_t count = size - i < row ? size - i : row;
+        size_t mapped;
+        if (c->scale != NULL)
+        {
+            mapped = scale_bytes(c, bytes + i, count);
+        }
+        else
+        {
+            mapped = map_bytes(c, bytes + i, count, output + out);
+            out += mapped;
+        }
+        i += mapped;
+        c->pixels += mapped;
+        c->column += mapped;
+        if (mapped < count)
+        {
+            c->status = PGM_ERROR_OVER_SCALE;
+            break;
+        }
+        if (c->column == c->header->x)
+        {
+            c->column = 0;
+            if (c->scale != NULL)
+            {
+                out += scale_row(c, output + out);
+            }
+            else
+            {
+                output[out++] = '\n';
+            }
+        }
+    }
+
+    *written = out;
+    return i;
+}
+
+// Convert part of the raster, which can end anywhere (even inside a number).
+// Stores at most two bytes for every byte of 'data' (and a row of the downscaled
+// image) to 'output' and their count to 'written'. Returns number of bytes of
+// 'data' used, it is smaller than 'size' only if the image is complete or
+// 'c->status' is set to an error.
+static size_t convert_chunk(converter *c, const char *data, size_t size, char *output,
+                            size_t *written)
+{
+    if (c->header->binary)
+    {
+        return convert_binary(c, data, size, output, written);
+    }
+
+    size_t i = 0;
+    size_t out = 0;
+
+#if defined(__AVX2__) || defined(__SSE2__)
+    // Blocks of digits and whitespaces are converted with SIMD, blocks with
+    // comments or invalid characters, blocks before the first number decides if
+    // the digits are packed and blocks which may contain the last pixel byte by
+    // byte
+    uint64_t total = converter_total_pixels(c);
+    unsigned char padded_values[BLOCK_SIZE + 2] = {0};
+    unsigned char *values = padded_values + 2;
+    while (i + BLOCK_SIZE <= size && c->status == PGM_OK && total - c->pixels > BLOCK_SIZE)
+    {
+        block_mask digits, spaces;
+        classify_block(data + i, &digits, &spaces, values);
+        if (c->in_comment || !c->packed_known || (digits | spaces) != BLOCK_FULL)
+        {
+            size_t block_written;
+            i += convert_scalar(c, data + i, BLOCK_SIZE, output + out, &block_written);
+            out += block_written;
+            continue;
+        }
+
+        out += convert_block(c, values, digits, output + out);
+        i += BLOCK_SIZE;
+    }
+    if (c->status != PGM_OK)
+    {
+        *written = out;
+        return i;
+    }
+#endif
+
+    size_t rest_written;
+    i += convert_scalar(c, data + i, size - i, output + out, &rest_written);
+    *written = out + rest_written;
+    return i;
+}
+
+// Finish the conversion at the end of the input, returns number of bytes stored to
+// 'output' (at most two)
+static size_t convert_finish(converter *c, char *output)
+{
+    size_t out = 0;
+    // A half of a two byte pixel is not a pixel
+    if (c->in_number && c->status == PGM_OK && !c->header->binary)
+    {
+        out = convert_pixel(c, c->value, output);
+        c->in_number = false;
+    }
+    if (c->status == PGM_OK && c->pixels < converter_total_pixels(c))
+    {
+        c->status = PGM_ERROR_TRUNCATED;
+    }
+    return out;
+}
+
+// Check the raster after the last pixel of a P2 image, only whitespaces and comments
+// may follow it, otherwise 'c->status' is set. Returns true if 'data' has nothing
+// else, so the check continues with the next chunk.
+static bool check_rest(converter *c, const char *data, size_t size)
+{
+    if (c->status != PGM_OK || c->header->binary || c->pixels != converter_total_pixels(c))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < size; i++)
+    {
+        if (c->in_comment)
+        {
+            c->in_comment = !char_is_newline(data[i]);
+        }
+        else if (char_is_comment(data[i]))
+        {
+            c->in_comment = true;
+        }
+        else if (!char_is_whitespace(data[i]))
+        {
+            c->status = char_is_digit(data[i]) ? PGM_ERROR_LEFTOVER : PGM_ERROR_DATA;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Exact size of the output of the whole image, every row ends with a new line
+static size_t calc_output_size(pgm_header *header, options *opt)
+{
+    int cols, rows;
+    calc_output_dimensions(header, opt, &cols, &rows);
+    return ((size_t)cols + 1) * rows;
+}
+
+#ifndef PGMTOASCII_LIBRARY
+// Read from 'input' until 'buffer' has 'size' bytes or the input ends, 'status' is
+// set if the input can not be read
+static size_t read_chunk(FILE *input, char *buffer, size_t size, pgm_status *status)
+{
+    size_t length = fread(buffer, 1, size, input);
+    if (length < size && ferror(input))
+    {
+        *status = PGM_ERROR_READ;
+    }
+    return length;
+}
+
+static void write_chunk(FILE *output, char *data, size_t size, pgm_status *status)
+{
+    if (size > 0 && fwrite(data, 1, size, output) != size)
+    {
+        *status = PGM_ERROR_WRITE;
+    }
+}
+#endif
+
+static void start_worker(worker *w, WORKER_RESULT (*function)(void *), void *arg)
+{
+#ifdef linux
+    if (pthread_create(w, NULL, function, arg) != 0)
+    {
+        error("Error: Could not create thread \n");
+    }
+#endif
+#ifdef _WIN32
+    *w = CreateThread(NULL, 0, function, arg, 0, NULL);
+    if (*w == NULL)
+    {
+        error("Error: Could not create thread \n");
+    }
+#endif
+}
+
+static void join_worker(worker w)
+{
+#ifdef linux
+    pthread_join(w, NULL);
+#endif
+#ifdef _WIN32
+    WaitForSingleObject(w, INFINITE);
+    CloseHandle(w);
+#endif
+}
+
+// Run 'function' for every part, the first part is done by the calling thread
+static void run_parts(WORKER_RESULT (*function)(void *), part *parts, int count)
+{
+    worker workers[MAX_THREADS];
+    for (int i = 1; i < count; i++)
+    {
+        start_worker(&workers[i], function, &parts[i]);
+    }
+    function(&parts[0]);
+    for (int i = 1; i < count; i++)
+    {
+        join_worker(workers[i]);
+    }
+}
+
+// The library converts images in memory, it has no files, streams and I/O engine
+#ifndef PGMTOASCII_LIBRARY
+#ifdef IO_URING
+#define IO_URING_ENTRIES 4
+
+static void uring_free(io_engine *io)
+{
+    if (io->sqes != MAP_FAILED)
+        munmap(io->sqes, io->sqes_size);
+    if (io->cq_ring != MAP_FAILED && io->cq_ring != io->sq_ring)
+        munmap(io->cq_ring, io->cq_ring_size);
+    if (io->sq_ring != MAP_FAILED)
+        munmap(io->sq_ring, io->sq_ring_size);
+    close(io->ring);
+}
+
+// Set up io_uring by raw system calls, returns false if the kernel has no io_uring
+// (or it is disabled), the engine uses threads then
+static bool uring_init(io_engine *io)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    io->ring = syscall(__NR_io_uring_setup, IO_URING_ENTRIES, &params);
+    if (io->ring < 0)
+    {
+        return false;
+    }
+
+    io->sq_ring = io->cq_ring = io->sqes = MAP_FAILED;
+    // Pipes have no offset, reads and writes are done at the position of the file
+    if (!(params.features & IORING_FEAT_RW_CUR_POS))
+    {
+        uring_free(io);
+        return false;
+    }
+
+    io->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    io->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && io->cq_ring_size > io->sq_ring_size)
+    {
+        io->sq_ring_size = io->cq_ring_size;
+    }
+
+    io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, io->ring, IORING_OFF_SQ_RING);
+    io->cq_ring = single ? io->sq_ring
+                         : mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, io->ring, IORING_OFF_CQ_RING);
+    io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    io->ring, IORING_OFF_SQES);
+    if (io->sq_ring == MAP_FAILED || io->cq_ring == MAP_FAILED || io->sqes == MAP_FAILED)
+    {
+        uring_free(io);
+        return false;
+    }
+
+    char *sq = io->sq_ring;
+    char *cq = io->cq_ring;
+    io->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    io->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    io->sq_array = (unsigned *)(sq + params.sq_off.array);
+    io->cq_head = (unsigned *)(cq + params.cq_off.head);
+    io->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    io->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return true;
+}
+
+// Submit the rest of request 'r', only this thread submits, so the tail of the
+// queue is read without synchronization
+static void uring_submit(io_engine *io, io_request *r)
+{
+    unsigned tail = *io->sq_tail;
+    unsigned index = tail & *io->sq_mask;
+    struct io_uring_sqe *sqe = &io->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = r->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fileno(r->file);
+    sqe->addr = (uintptr_t)(r->buffer + r->done);
+    sqe->len = r->size - r->done;
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = (uintptr_t)r;
+    io->sq_array[index] = index;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    long result;
+    while ((result = syscall(__NR_io_uring_enter, io->ring, 1, 0, 0, NULL, 0)) < 0 &&
+           errno == EINTR)
+        ;
+    if (result < 0)
+    {
+        r->status = r->write ? PGM_ERROR_WRITE : PGM_ERROR_READ;
+        r->pending = false;
+    }
+}
+
+// Wait until request 'r' is done. The completions of the other request are handled
+// too, a short write is submitted again for the rest of it.
+static void uring_wait(io_engine *io, io_request *r)
+{
+    while (r->pending)
+    {
+        unsigned head = *io->cq_head;
+        if (head == __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            // Waiting can not fail again and again, the request fails instead
+            if (syscall(__NR_io_uring_enter, io->ring, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+                errno != EINTR)
+            {
+                r->status = r->write ? PGM_ERROR_WRITE : PGM_ERROR_READ;
+                r->pending = false;
+            }
+            continue;
+        }
+
+        struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+        io_request *done = (io_request *)(uintptr_t)cqe->user_data;
+        int result = cqe->res;
+        __atomic_store_n(io->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        if (result == -EINTR || result == -EAGAIN)
+        {
+            uring_submit(io, done);
+        }
+        else if (result < 0 || (result == 0 && done->write))
+        {
+            done->status = done->write ? PGM_ERROR_WRITE : PGM_ERROR_READ;
+            done->pending = false;
+        }
+        else
+        {
+            done->done += result;
+            if (!done->write || done->done == done->size)
+                done->pending = false;
+            else
+                uring_submit(io, done);
+        }
+    }
+}
+#endif
+
+#ifdef linux
+// Thread of the engine without io_uring, it does the requests of one direction
+static WORKER_RESULT io_thread(void *arg)
+{
+    io_request *r = arg;
+    pthread_mutex_lock(&r->lock);
+    while (true)
+    {
+        while (!r->pending && !r->quit)
+        {
+            pthread_cond_wait(&r->cond, &r->lock);
+        }
+        if (r->quit)
+        {
+            break;
+        }
+        pthread_mutex_unlock(&r->lock);
+
+        pgm_status status = PGM_OK;
+        size_t done = r->size;
+        if (r->write)
+        {
+            write_chunk(r->file, r->buffer, r->size, &status);
+        }
+        else
+        {
+            ssize_t length;
+            while ((length = read(fileno(r->file), r->buffer, r->size)) < 0 && errno == EINTR)
+                ;
+            if (length < 0)
+            {
+                status = PGM_ERROR_READ;
+            }
+            done = length < 0 ? 0 : length;
+        }
+
+        pthread_mutex_lock(&r->lock);
+        r->done = done;
+        r->status = status;
+        r->pending = false;
+        pthread_cond_signal(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return 0;
+}
+#endif
+
+// Start the engine, with io_uring if the kernel has it, otherwise with a thread for
+// reads and a thread for writes. In windows the requests are done synchronously.
+static void io_engine_init(io_engine *io)
+{
+    memset(io, 0, sizeof(*io));
+    io->write.write = true;
+#ifdef IO_URING
+    io->uring = uring_init(io);
+    if (io->uring)
+    {
+        return;
+    }
+#endif
+#ifdef linux
+    io_request *requests[] = {&io->read, &io->write};
+    for (int i = 0; i < 2; i++)
+    {
+        pthread_mutex_init(&requests[i]->lock, NULL);
+        pthread_cond_init(&requests[i]->cond, NULL);
+        start_worker(&requests[i]->thread, io_thread, requests[i]);
+    }
+#endif
+}
+
+// Stop the engine, no request may be in flight
+static void io_engine_free(io_engine *io)
+{
+#ifdef IO_URING
+    if (io->uring)
+    {
+        uring_free(io);
+        return;
+    }
+#endif
+#ifdef linux
+    io_request *requests[] = {&io->read, &io->write};
+    for (int i = 0; i < 2; i++)
+    {
+        pthread_mutex_lock(&requests[i]->lock);
+        requests[i]->quit = true;
+        pthread_cond_signal(&requests[i]->cond);
+        pthread_mutex_unlock(&requests[i]->lock);
+        join_worker(requests[i]->thread);
+        pthread_mutex_destroy(&requests[i]->lock);
+        pthread_cond_destroy(&requests[i]->cond);
+    }
+#endif
+}
+
+// Start reading at most 'size' bytes of 'file' to 'buffer' (or writing them from it),
+// the buffer must not be touched until io_wait returns
+static void io_start(io_engine *io, io_request *r, FILE *file, char *buffer, size_t size)
+{
+#ifndef IO_URING
+    (void)io;
+#endif
+    r->file = file;
+    r->buffer = buffer;
+    r->size = size;
+    r->done = 0;
+    r->status = PGM_OK;
+    if (size == 0)
+    {
+        return;
+    }
+#ifdef IO_URING
+    if (io->uring)
+    {
+        r->pending = true;
+        uring_submit(io, r);
+        return;
+    }
+#endif
+#ifdef linux
+    pthread_mutex_lock(&r->lock);
+    r->pending = true;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+#endif
+#ifdef _WIN32
+    if (r->write)
+        write_chunk(file, buffer, size, &r->status);
+    else
+        r->done = read_chunk(file, buffer, size, &r->status);
+#endif
+}
+
+// Wait for request 'r', returns the number of bytes transferred, 'status' is set
+// if it failed and it is PGM_OK
+static size_t io_wait(io_engine *io, io_request *r, pgm_status *status)
+{
+#ifndef IO_URING
+    (void)io;
+#endif
+#ifdef IO_URING
+    if (io->uring)
+    {
+        uring_wait(io, r);
+    }
+    else
+#endif
+    {
+#ifdef linux
+        pthread_mutex_lock(&r->lock);
+        while (r->pending)
+        {
+            pthread_cond_wait(&r->cond, &r->lock);
+        }
+        pthread_mutex_unlock(&r->lock);
+#endif
+    }
+    if (r->status != PGM_OK && *status == PGM_OK)
+    {
+        *status = r->status;
+    }
+    return r->done;
+}
+
+// Allocate the buffers of a stream and start its engine, they are reused for every
+// file converted with it
+static void stream_init(stream *s)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        s->chunk[i] = malloc(CHUNK_SIZE);
+        s->output[i] = malloc(CHUNK_OUTPUT_SIZE);
+        if (s->chunk[i] == NULL || s->output[i] == NULL)
+        {
+            error("Error: Could not allocate memory for buffer \n");
+        }
+        s->frame[i] = NULL;
+    }
+    s->header = malloc(CHUNK_SIZE);
+    if (s->header == NULL)
+    {
+        error("Error: Could not allocate memory for buffer \n");
+    }
+    s->delta = NULL;
+    s->frame_capacity = 0;
+    io_engine_init(&s->io);
+}
+
+static void stream_free(stream *s)
+{
+    io_engine_free(&s->io);
+    for (int i = 0; i < 2; i++)
+    {
+        free(s->chunk[i]);
+        free(s->output[i]);
+        free(s->frame[i]);
+    }
+    free(s->header);
+    free(s->delta);
+}
+
+// Move to the chunk which was read ahead and start reading the next one to the
+// other buffer. Returns false at the end of the input or if the read failed, then
+// 'status' is set.
+static bool stream_next_chunk(stream *s, pgm_status *status)
+{
+    if (s->last)
+    {
+        return false;
+    }
+    size_t size = io_wait(&s->io, &s->io.read, status);
+    if (*status != PGM_OK || size == 0)
+    {
+        s->last = true;
+        return false;
+    }
+
+    s->k = 1 - s->k;
+    s->size = size;
+    s->pos = 0;
+    io_start(&s->io, &s->io.read, s->input, s->chunk[1 - s->k], CHUNK_SIZE);
+    return true;
+}
+
+// Start reading 'input' with a stream, the first chunk is read right away
+static pgm_status stream_start(stream *s, FILE *input)
+{
+    s->input = input;
+    s->k = 1;
+    s->size = 0;
+    s->pos = 0;
+    s->last = false;
+    s->o = 0;
+    s->cols = 0;
+    s->rows = 0;
+    pgm_status status = PGM_OK;
+    io_start(&s->io, &s->io.read, input, s->chunk[0], CHUNK_SIZE);
+    stream_next_chunk(s, &status);
+    return status;
+}
+
+// Parse the header at the position of the stream. If the header continues in the
+// next chunks, it is joined in 's->header', it may have at most CHUNK_SIZE bytes.
+// The position is moved to the raster.
+static pgm_status stream_read_header(stream *s, pgm_header *header)
+{
+    char *data = s->chunk[s->k] + s->pos;
+    size_t length = s->size - s->pos;
+    pgm_status status = parse_pgm_header(data, length, header);
+    if (status != PGM_INCOMPLETE)
+    {
+        s->pos += status == PGM_OK ? header->size : 0;
+        return status;
+    }
+
+    memcpy(s->header, data, length);
+    size_t before = length;
+    pgm_status read_status = PGM_OK;
+    while (status == PGM_INCOMPLETE && length < CHUNK_SIZE && stream_next_chunk(s, &read_status))
+    {
+        size_t count = s->size < CHUNK_SIZE - length ? s->size : CHUNK_SIZE - length;
+        memcpy(s->header + length, s->chunk[s->k], count);
+        before = length;
+        length += count;
+        status = parse_pgm_header(s->header, length, header);
+    }
+    if (read_status != PGM_OK)
+    {
+        return read_status;
+    }
+    if (status == PGM_OK)
+    {
+        s->pos = header->size - before;
+    }
+    return status;
+}
+
+// Skip whitespaces after a frame, returns false at the end of the input
+static bool stream_skip_space(stream *s, pgm_status *status)
+{
+    while (true)
+    {
+        while (s->pos < s->size && char_is_whitespace(s->chunk[s->k][s->pos]))
+        {
+            s->pos++;
+        }
+        if (s->pos < s->size)
+        {
+            return true;
+        }
+        if (!stream_next_chunk(s, status))
+        {
+            return false;
+        }
+    }
+}
+
+// Write 'size' bytes of the current output buffer when the previous one is written,
+// the next conversion goes to the other buffer
+static void stream_write(stream *s, FILE *output, size_t size, pgm_status *status)
+{
+    io_wait(&s->io, &s->io.write, status);
+    io_start(&s->io, &s->io.write, output, s->output[s->o], size);
+    s->o = 1 - s->o;
+}
+
+// Convert the raster of one image from the position of the stream, the stream is
+// left right after the last pixel. The output is written, or stored to 'frame' if
+// it is not NULL, returns number of bytes stored to it.
+static size_t stream_convert_image(stream *s, FILE *output, converter *c, char *frame)
+{
+    size_t stored = 0;
+    while (true)
+    {
+        char *out = frame != NULL ? frame + stored : s->output[s->o];
+        size_t written;
+        s->pos += convert_chunk(c, s->chunk[s->k] + s->pos, s->size - s->pos, out, &written);
+        if (frame != NULL)
+            stored += written;
+        else
+            stream_write(s, output, written, &c->status);
+
+        if (c->status != PGM_OK || c->pixels == converter_total_pixels(c) ||
+            !stream_next_chunk(s, &c->status))
+        {
+            break;
+        }
+    }
+
+    char *out = frame != NULL ? frame + stored : s->output[s->o];
+    size_t written = convert_finish(c, out);
+    if (frame != NULL)
+        stored += written;
+    else if (written > 0)
+        stream_write(s, output, written, &c->status);
+    return stored;
+}
+
+// Check the rest of the input after a single image, see check_rest
+static void stream_check_rest(stream *s, converter *c)
+{
+    bool more = check_rest(c, s->chunk[s->k] + s->pos, s->size - s->pos);
+    while (more && stream_next_chunk(s, &c->status))
+    {
+        more = check_rest(c, s->chunk[s->k], s->size);
+    }
+}
+
+// Rows of 'frame' which differ from 'previous', every one after an escape which
+// moves the cursor to it, then the cursor is moved below the image. If 'whole' is
+// true, the screen is cleared and the whole frame is stored. Returns number of
+// bytes stored to 'output'.
+static size_t delta_rows(const char *frame, const char *previous, int cols, int rows, bool whole,
+                         char *output)
+{
+    size_t row_size = (size_t)cols + 1;
+    size_t out = 0;
+    if (whole)
+    {
+        out = sprintf(output, ESCAPE_CLEAR);
+        memcpy(output + out, frame, row_size * rows);
+        return out + row_size * rows;
+    }
+
+    bool changed = false;
+    for (int row = 0; row < rows; row++)
+    {
+        const char *line = frame + row * row_size;
+        if (memcmp(line, previous + row * row_size, cols) != 0)
+        {
+            out += sprintf(output + out, ESCAPE_MOVE, row + 1);
+            memcpy(output + out, line, cols);
+            out += cols;
+            changed = true;
+        }
+    }
+    if (changed)
+    {
+        out += sprintf(output + out, ESCAPE_MOVE, rows + 1);
+    }
+    return out;
+}
+
+// Convert one image of --delta to 's->frame[0]' and write the rows which differ
+// from the previous frame. The write is in flight while the next frame is converted.
+static void stream_convert_delta(stream *s, FILE *output, converter *c, options *opt)
+{
+    int cols, rows;
+    calc_output_dimensions(c->header, opt, &cols, &rows);
+    size_t frame_size = ((size_t)cols + 1) * rows;
+    if (frame_size > s->frame_capacity)
+    {
+        // The delta of the previous frame may be being written
+        io_wait(&s->io, &s->io.write, &c->status);
+        for (int i = 0; i < 2; i++)
+        {
+            free(s->frame[i]);
+            s->frame[i] = malloc(frame_size);
+        }
+        free(s->delta);
+        s->delta = malloc(frame_size + ((size_t)rows + 1) * ESCAPE_MAX_LENGTH +
+                          strlen(ESCAPE_CLEAR) + 1);
+        if (s->frame[0] == NULL || s->frame[1] == NULL || s->delta == NULL)
+        {
+            error("Error: Could not allocate memory for frame \n");
+        }
+        s->frame_capacity = frame_size;
+        // The previous frame is lost, the next one is whole
+        s->cols = 0;
+    }
+
+    stream_convert_image(s, output, c, s->frame[0]);
+    if (c->status != PGM_OK)
+    {
+        return;
+    }
+
+    io_wait(&s->io, &s->io.write, &c->status);
+    bool whole = cols != s->cols || rows != s->rows;
+    size_t size = delta_rows(s->frame[0], s->frame[1], cols, rows, whole, s->delta);
+    io_start(&s->io, &s->io.write, output, s->delta, size);
+
+    char *previous = s->frame[1];
+    s->frame[1] = s->frame[0];
+    s->frame[0] = previous;
+    s->cols = cols;
+    s->rows = rows;
+}
+
+// Convert pgm from 'input' to 'output' in chunks. Chunk k is converted while chunk
+// k + 1 is read and the output of the previous chunk is written. With --frames
+// every image of the input is converted, images may be separated by whitespaces.
+// Returns PGM_OK or the reason of the failure, the output has what was converted
+// before.
+static pgm_status convert_stream_buffers(FILE *input, FILE *output, options *opt, stream *s)
+{
+    pgm_status status = stream_start(s, input);
+    bool first = true;
+    while (status == PGM_OK)
+    {
+        if (!first && (!opt->frames || !stream_skip_space(s, &status)))
+        {
+            break;
+        }
+        first = false;
+
+        pgm_header header;
+        if ((status = stream_read_header(s, &header)) != PGM_OK)
+        {
+            break;
+        }
+        converter c;
+        converter_init(&c, &header, opt);
+        if (opt->delta)
+            stream_convert_delta(s, output, &c, opt);
+        else
+            stream_convert_image(s, output, &c, NULL);
+        if (!opt->frames)
+        {
+            stream_check_rest(s, &c);
+        }
+        status = c.status;
+        converter_free(&c);
+    }
+
+    // The image may end before the input, the read in flight is not needed then
+    pgm_status unused = PGM_OK;
+    io_wait(&s->io, &s->io.read, &unused);
+    io_wait(&s->io, &s->io.write, &status);
+    return status;
+}
+
+// Convert pgm from 'input' to 'output' in chunks, so only two buffers of each kind
+// are allocated however large the image is
+static void convert_stream(FILE *input, FILE *output, options *opt)
+{
+    stream s;
+    stream_init(&s);
+    pgm_status status = convert_stream_buffers(input, output, opt, &s);
+    stream_free(&s);
+    if (status != PGM_OK)
+    {
+        pgm_status_is_wrong(status);
+    }
+}
+#endif
+
+// Count numbers (or digits if the gray levels are packed) of 'data' byte by byte
+static uint64_t count_scalar(const char *data, size_t size, bool packed, bool *previous_digit,
+                             bool *has_comment)
+{
+    uint64_t pixels = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        bool digit = char_is_digit(data[i]);
+        pixels += digit && (packed || !*previous_digit);
+        *previous_digit = digit;
+        *has_comment |= char_is_comment(data[i]);
+    }
+    return pixels;
+}
+
+// Count pixels of the part, which starts at the start of a number (or of a digit
+// if the gray levels are packed)
+static WORKER_RESULT count_part(void *arg)
+{
+    part *p = arg;
+    bool packed = p->c.packed;
+    bool previous_digit = false;
+    uint64_t pixels = 0;
+    size_t i = 0;
+
+#if defined(__AVX2__) || defined(__SSE2__)
+    unsigned char values[BLOCK_SIZE];
+    for (; i + BLOCK_SIZE <= p->size; i += BLOCK_SIZE)
+    {
+        block_mask digits, spaces;
+        classify_block(p->data + i, &digits, &spaces, values);
+        if ((digits | spaces) != BLOCK_FULL)
+        {
+            pixels += count_scalar(p->data + i, BLOCK_SIZE, packed, &previous_digit,
+                                   &p->has_comment);
+            continue;
+        }
+
+        block_mask starts = packed ? digits : digits & ~(digits << 1 | previous_digit);
+        pixels += __builtin_popcount(starts);
+        previous_digit = (digits >> (BLOCK_SIZE - 1)) & 1;
+    }
+#endif
+
+    pixels += count_scalar(p->data + i, p->size - i, packed, &previous_digit, &p->has_comment);
+    p->pixels = pixels;
+    return 0;
+}
+
+static WORKER_RESULT convert_part(void *arg)
+{
+    part *p = arg;
+    p->used = convert_chunk(&p->c, p->data, p->size, p->output, &p->written);
+    return 0;
+}
+
+// Offset of the pixel in the output, every row ends with a new line
+static uint64_t pixel_offset(pgm_header *header, uint64_t pixel)
+{
+    return pixel + pixel / header->x;
+}
+
+// Decide if the digits are packed from the first number of 'data', which does not
+// start inside a number, the same way as convert_scalar. Returns false if 'data'
+// does not show it.
+static bool decide_packed(converter *c, const char *data, size_t size)
+{
+    size_t i = 0;
+    while (i < size && char_is_whitespace(data[i]))
+    {
+        i++;
+    }
+    if (i >= size || !char_is_digit(data[i]))
+    {
+        return false;
+    }
+
+    size_t start = i;
+    bool nonzero = false;
+    for (; i < size && char_is_digit(data[i]); i++)
+    {
+        size_t digits = i - start + 1;
+        if (digits >= 2 && (nonzero || digits >= (size_t)c->header->x))
+        {
+            c->packed = true;
+            c->packed_known = true;
+            return true;
+        }
+        nonzero = data[i] != '0';
+    }
+    if (i == size)
+    {
+        return false;
+    }
+    c->packed = false;
+    c->packed_known = true;
+    return true;
+}
+
+// Convert 'data' which ends after a whitespace or a whole pixel of a binary raster
+// (or at the end of the input) by 'count' threads. The data is split into parts
+// after whitespaces, the pixels of every part are counted in parallel and then
+// every part is converted to its offset in 'output'. Returns number of bytes
+// stored to 'output' and sets 'used' to number of bytes of 'data' converted, if a
+// part fails, the output ends where it failed and 'c->status' is set.
+static size_t convert_window(converter *c, const char *data, size_t size, char *output, int count,
+                             size_t *used)
+{
+    // Until the first number decides if the digits are packed, one thread converts
+    if (!c->packed_known && !decide_packed(c, data, size))
+    {
+        size_t written;
+        *used = convert_chunk(c, data, size, output, &written);
+        return written;
+    }
+
+    bool packed = c->packed;
+    bool binary = c->header->binary;
+    // Parts of a binary raster are split between pixels and need no counting
+    size_t unit = binary ? pixel_size(c->header) : 1;
+    part parts[MAX_THREADS] = {0};
+
+    size_t start = 0;
+    for (int i = 0; i < count; i++)
+    {
+        size_t end = i == count - 1 ? size : size / count * (i + 1) / unit * unit;
+        if (end < start)
+        {
+            end = start;
+        }
+        while (!packed && !binary && end > start && end < size &&
+               !char_is_whitespace(data[end - 1]))
+        {
+            end++;
+        }
+
+        parts[i].c = *c;
+        parts[i].data = data + start;
+        parts[i].size = end - start;
+        parts[i].pixels = parts[i].size / unit;
+        parts[i].has_comment = false;
+        start = end;
+    }
+
+    if (!binary)
+    {
+        run_parts(count_part, parts, count);
+    }
+
+    // A comment can contain digits, it is left to one thread
+    for (int i = 0; i < count; i++)
+    {
+        if (parts[i].has_comment)
+        {
+            size_t written;
+            *used = convert_chunk(c, data, size, output, &written);
+            return written;
+        }
+    }
+
+    uint64_t total = converter_total_pixels(c);
+    uint64_t first = pixel_offset(c->header, c->pixels);
+    uint64_t pixels = c->pixels;
+    for (int i = 0; i < count; i++)
+    {
+        parts[i].c.pixels = pixels < total ? pixels : total;
+        parts[i].c.column = parts[i].c.pixels % c->header->x;
+        parts[i].output = output + (pixel_offset(c->header, parts[i].c.pixels) - first);
+        pixels += parts[i].pixels;
+    }
+
+    run_parts(convert_part, parts, count);
+
+    // The image ends in the part which converted its last pixel
+    for (int i = 0; i < count; i++)
+    {
+        if (parts[i].c.status != PGM_OK || parts[i].c.pixels == total || i == count - 1)
+        {
+            *c = parts[i].c;
+            *used = parts[i].data - data + parts[i].used;
+            return parts[i].output - output + parts[i].written;
+        }
+    }
+    return 0;
+}
+
+#ifndef PGMTOASCII_LIBRARY
+// Same as convert_stream, but the raster is read in windows of 'threads' times
+// THREAD_CHUNK_SIZE bytes, which are converted by 'threads' threads
+static void convert_stream_threads(FILE *input, FILE *output, options *opt)
+{
+    int threads = opt->threads;
+    size_t window_size = (size_t)threads * THREAD_CHUNK_SIZE;
+    char *window = malloc(window_size);
+    char *window_output = malloc(2 * window_size);
+    if (window == NULL || window_output == NULL)
+    {
+        error("Error: Could not allocate memory for buffer \n");
+    }
+
+    // The header must be in the first window, it is parsed in place
+    pgm_header header;
+    pgm_status status = PGM_OK;
+    size_t size = read_chunk(input, window, window_size, &status);
+    if (status != PGM_OK || (status = parse_pgm_header(window, size, &header)) != PGM_OK)
+    {
+        pgm_status_is_wrong(status);
+    }
+
+    converter c;
+    converter_init(&c, &header, opt);
+
+    size_t start = header.size;
+    size_t used = 0;
+    bool last;
+    while (true)
+    {
+        // The window ends after its last whitespace (or whole pixel), the rest of
+        // the number is moved to the next window
+        last = size < window_size;
+        size_t end = size;
+        if (!last && header.binary)
+        {
+            end = start + (size - start) / pixel_size(&header) * pixel_size(&header);
+        }
+        while (!last && !header.binary && !c.packed && end > start &&
+               !char_is_whitespace(window[end - 1]))
+        {
+            end--;
+        }
+        if (end == start)
+        {
+            end = size;
+        }
+
+        size_t written;
+        if (c.in_number || c.in_comment)
+        {
+            used = convert_chunk(&c, window + start, end - start, window_output, &written);
+        }
+        else
+        {
+            written = convert_window(&c, window + start, end - start, window_output, threads,
+                                     &used);
+        }
+        write_chunk(output, window_output, written, &c.status);
+        if (c.status != PGM_OK || c.pixels == converter_total_pixels(&c) || last)
+        {
+            break;
+        }
+
+        size_t rest = size - end;
+        memmove(window, window + end, rest);
+        size = rest + read_chunk(input, window + rest, window_size - rest, &c.status);
+        if (c.status != PGM_OK)
+        {
+            break;
+        }
+        start = 0;
+    }
+
+    write_chunk(output, window_output, convert_finish(&c, window_output), &c.status);
+    bool more = check_rest(&c, window + start + used, size - start - used);
+    while (more && !last)
+    {
+        size = read_chunk(input, window, window_size, &c.status);
+        last = size < window_size;
+        more = c.status == PGM_OK && check_rest(&c, window, size);
+    }
+    if (c.status != PGM_OK)
+    {
+        pgm_status_is_wrong(c.status);
+    }
+
+    converter_free(&c);
+    free(window);
+    free(window_output);
+}
+#endif
+
+// Convert the whole raster with a started converter by 'threads' threads (they can
+// not downscale), returns number of bytes stored to 'output'
+static size_t convert_raster(converter *c, const char *raster, size_t raster_size, char *output,
+                             int threads)
+{
+    size_t written;
+    size_t used;
+    if (threads > 1 && c->scale == NULL)
+    {
+        written = convert_window(c, raster, raster_size, output, threads, &used);
+    }
+    else
+    {
+        used = convert_chunk(c, raster, raster_size, output, &written);
+    }
+    written += convert_finish(c, output + written);
+    check_rest(c, raster + used, raster_size - used);
+    return written;
+}
+
+#ifndef PGMTOASCII_LIBRARY
+// Convert pgm file which is whole in memory right to 'output' of calc_output_size
+// bytes. Returns number of bytes written, it is smaller only if the conversion
+// failed, then 'status' is set to the reason.
+static size_t convert_pgm_to_ascii(pgm pgm, options *opt, char *output, pgm_status *status)
+{
+    converter c;
+    converter_init(&c, pgm.header, opt);
+    size_t written = convert_raster(&c, pgm.file.data + pgm.header->size,
+                                    pgm.file.size - pgm.header->size, output, opt->threads);
+    *status = c.status;
+    converter_free(&c);
+    return written;
+}
+#endif
+
+pgm_context *pgm_context_create(const char *char_set, double gamma, int cols, int rows,
+                                pgm_status *status)
+{
+    if (char_set == NULL || !is_charset_length_correct((char *)char_set) || !(gamma > 0) ||
+        cols < 0 || cols > UINT16_MAX || rows < 0 || rows > UINT16_MAX)
+    {
+        *status = PGM_ERROR_OPTIONS;
+        return NULL;
+    }
+
+    pgm_context *context = calloc(1, sizeof(pgm_context));
+    char *copy = malloc(strlen(char_set) + 1);
+    // The header allows at most UINT16_MAX columns
+    uint32_t *sums = cols > 0 || rows > 0 ? malloc((UINT16_MAX + 1) * sizeof(uint32_t)) : NULL;
+    if (context == NULL || copy == NULL || ((cols > 0 || rows > 0) && sums == NULL))
+    {
+        free(context);
+        free(copy);
+        free(sums);
+        *status = PGM_ERROR_MEMORY;
+        return NULL;
+    }
+
+    context->opt.char_set = strcpy(copy, char_set);
+    context->opt.gamma = gamma;
+    context->opt.threads = 1;
+    context->opt.cols = cols;
+    context->opt.rows = rows;
+    context->opt.batch = false;
+    context->opt.frames = false;
+    context->opt.delta = false;
+    context->table_n = 0;
+    context->scale.sums = sums;
+    *status = PGM_OK;
+    return context;
+}
+
+void pgm_context_destroy(pgm_context *context)
+{
+    if (context == NULL)
+    {
+        return;
+    }
+    free(context->opt.char_set);
+    free(context->scale.sums);
+    free(context);
+}
+
+// The data are the whole image, so a header which does not end is not correct
+static pgm_status parse_whole_header(const char *data, size_t size, pgm_header *header)
+{
+    pgm_status status = parse_pgm_header(data, size, header);
+    return status == PGM_INCOMPLETE ? PGM_ERROR_HEADER : status;
+}
+
+pgm_status pgm_output_size(pgm_context *context, const char *data, size_t size,
+                           size_t *output_size)
+{
+    pgm_header header;
+    pgm_status status = parse_whole_header(data, size, &header);
+    if (status == PGM_OK)
+    {
+        *output_size = calc_output_size(&header, &context->opt);
+    }
+    return status;
+}
+
+pgm_status pgm_convert(pgm_context *context, const char *data, size_t size, char *output,
+                       size_t capacity, size_t *written)
+{
+    *written = 0;
+    pgm_header header;
+    pgm_status status = parse_whole_header(data, size, &header);
+    if (status != PGM_OK)
+    {
+        return status;
+    }
+    if (capacity < calc_output_size(&header, &context->opt))
+    {
+        return PGM_ERROR_OUTPUT_SIZE;
+    }
+
+    if (context->table_n != header.n)
+    {
+        fill_table(context->table, &header, &context->opt);
+        context->table_n = header.n;
+    }
+    scaler *scale = NULL;
+    if (context->scale.sums != NULL)
+    {
+        scale = &context->scale;
+        scaler_start(scale, &header, &context->opt);
+    }
+
+    converter c;
+    converter_start(&c, &header, context->table, scale);
+    *written = convert_raster(&c, data + header.size, size - header.size, output, 1);
+    return c.status;
+}
+
+#ifndef PGMTOASCII_LIBRARY
+// Convert regular files, the input and the output are mapped to memory, so no
+// buffer is allocated and the data are not copied
+static void convert_mapped(char *input_file_path, char *output_file_path, options *opt)
+{
+    pgm pgm = read_pgm(input_file_path);
+    file output = create_file(output_file_path, calc_output_size(pgm.header, opt));
+    pgm_status status;
+    size_t written = convert_pgm_to_ascii(pgm, opt, output.data, &status);
+
+    // If the conversion failed, the output has what was converted before
+    close_file(&output, written);
+    close_file(&pgm.file, pgm.file.size);
+    free(pgm.header);
+    if (status != PGM_OK)
+    {
+        pgm_status_is_wrong(status);
+    }
+}
+
+// Regular files are mapped to memory, other files (pipes, devices) are read or
+// written in chunks. The output file is created if it does not exist.
+static bool can_map_file(char *path, bool is_output)
+{
+#ifdef linux
+    struct stat info;
+    if (stat(path, &info) != 0)
+    {
+        return is_output;
+    }
+    return S_ISREG(info.st_mode);
+#endif
+#ifdef _WIN32
+    return true;
+#endif
+}
+
+// New path of the name in the directory (or of the name only if 'directory' is
+// NULL) with the extension
+static char *join_path(const char *directory, const char *name, size_t name_length,
+                       const char *extension)
+{
+    size_t length = (directory != NULL ? strlen(directory) + strlen(PATH_SEPARATOR) : 0) +
+                    name_length + strlen(extension);
+    char *path = malloc(length + 1);
+    if (path == NULL)
+    {
+        error("Error: Could not allocate memory for path \n");
+    }
+    path[0] = '\0';
+    if (directory != NULL)
+    {
+        strcat(path, directory);
+        strcat(path, PATH_SEPARATOR);
+    }
+    strncat(path, name, name_length);
+    strcat(path, extension);
+    return path;
+}
+
+static void batch_add(batch *b, char *input, char *output)
+{
+    if (b->count == b->capacity)
+    {
+        b->capacity = b->capacity == 0 ? 64 : 2 * b->capacity;
+        b->files = realloc(b->files, b->capacity * sizeof(batch_file));
+        if (b->files == NULL)
+        {
+            error("Error: Could not allocate memory for batch \n");
+        }
+    }
+    b->files[b->count].input = input;
+    b->files[b->count].output = output;
+    b->count++;
+}
+
+static int compare_batch_files(const void *a, const void *b)
+{
+    return strcmp(((const batch_file *)a)->input, ((const batch_file *)b)->input);
+}
+
+// Every line of the manifest is an input and an output path separated by a tab, or
+// by spaces if there is no tab. Empty lines and lines starting with # are skipped.
+// A line which is too long or has no output file is reported and counted as a
+// failed file, the other lines are converted anyway.
+static void batch_read_manifest(batch *b, char *manifest_path)
+{
+    FILE *manifest = fopen(manifest_path, "r");
+    if (manifest == NULL)
+    {
+        errorf("Unable to open: %s\n", manifest_path);
+    }
+
+    char line[2 * FILENAME_MAX + 2];
+    int number = 0;
+    while (fgets(line, sizeof(line), manifest) != NULL)
+    {
+        number++;
+        size_t length = strlen(line);
+        if (length == sizeof(line) - 1 && line[length - 1] != '\n' && !feof(manifest))
+        {
+            // Skip the rest of the line, a part of it must not pass for a file
+            int c;
+            while ((c = fgetc(manifest)) != EOF && c != '\n')
+            {
+            }
+            printf("%s:%d: The line of the manifest is too long\n", manifest_path, number);
+            b->failed++;
+            continue;
+        }
+
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || char_is_comment(line[0]))
+        {
+            continue;
+        }
+
+        char *separator = strchr(line, '\t');
+        if (separator == NULL)
+        {
+            separator = strchr(line, ' ');
+        }
+        if (separator == NULL)
+        {
+            printf("%s:%d: The line of the manifest has no output file: %s\n", manifest_path,
+                   number, line);
+            b->failed++;
+            continue;
+        }
+        char *output = separator;
+        while (*output == '\t' || *output == ' ')
+        {
+            output++;
+        }
+        *separator = '\0';
+        batch_add(b, join_path(NULL, line, strlen(line), ""),
+                  join_path(NULL, output, strlen(output), ""));
+    }
+    fclose(manifest);
+}
+
+// Every .pgm file of the directory is converted to a .txt file of the same name in
+// the output directory
+static void batch_read_directory(batch *b, char *directory, char *output_directory)
+{
+    size_t extension_length = strlen(EXTENSION_INPUT);
+#ifdef linux
+    DIR *dir = opendir(directory);
+    if (dir == NULL)
+    {
+        errorf("Unable to open: %s\n", directory);
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        char *name = entry->d_name;
+#endif
+#ifdef _WIN32
+    char *pattern = join_path(directory, "*", 1, EXTENSION_INPUT);
+    WIN32_FIND_DATA entry;
+    HANDLE dir = FindFirstFile(pattern, &entry);
+    free(pattern);
+    if (dir == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+
+    do
+    {
+        char *name = entry.cFileName;
+#endif
+        size_t length = strlen(name);
+        if (length <= extension_length ||
+            strcmp(name + length - extension_length, EXTENSION_INPUT) != 0)
+        {
+            continue;
+        }
+        batch_add(b, join_path(directory, name, length, ""),
+                  join_path(output_directory, name, length - extension_length,
+                            EXTENSION_OUTPUT));
+#ifdef linux
+    }
+    closedir(dir);
+#endif
+#ifdef _WIN32
+    } while (FindNextFile(dir, &entry));
+    FindClose(dir);
+#endif
+
+    // Files are converted in the order of their names
+    qsort(b->files, b->count, sizeof(batch_file), compare_batch_files);
+}
+
+// Convert one file of the batch with buffers of the worker, returns the reason of
+// the failure instead of exiting
+static pgm_status convert_batch_file(batch_file *file, options *opt, stream *s)
+{
+    FILE *input = fopen(file->input, "rb");
+    if (input == NULL)
+    {
+        return PGM_ERROR_OPEN;
+    }
+    FILE *output = fopen(file->output, "w");
+    if (output == NULL)
+    {
+        fclose(input);
+        return PGM_ERROR_WRITE;
+    }
+    // The output is written in whole chunks, it needs no buffer of its own
+    setvbuf(output, NULL, _IONBF, 0);
+
+    pgm_status status = convert_stream_buffers(input, output, opt, s);
+    fclose(input);
+    if (fclose(output) != 0 && status == PGM_OK)
+    {
+        status = PGM_ERROR_WRITE;
+    }
+    return status;
+}
+
+// Worker of the batch, it takes the next file until all of them are converted. The
+// buffers are allocated once for all of its files.
+static WORKER_RESULT batch_worker(void *arg)
+{
+    batch *b = arg;
+    stream s;
+    stream_init(&s);
+
+    int i;
+    while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->count)
+    {
+        pgm_status status = convert_batch_file(&b->files[i], b->opt, &s);
+        if (status != PGM_OK)
+        {
+            printf("%s: %s", b->files[i].input, pgm_status_message(status));
+            __atomic_fetch_add(&b->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    stream_free(&s);
+    return 0;
+}
+
+static int count_cores()
+{
+#ifdef linux
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores < 1 ? 1 : cores;
+#endif
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#endif
+}
+
+// Convert all files of a manifest or a directory by a pool of threads, one per core
+// if --threads is not given. A file which fails is reported and the others are
+// converted anyway. Returns the exit code, 1 if any file failed.
+static int convert_batch(char *input_path, char *output_path, options *opt)
+{
+    batch b;
+    b.opt = opt;
+    b.files = NULL;
+    b.count = 0;
+    b.capacity = 0;
+    b.next = 0;
+    b.failed = 0;
+
+#ifdef linux
+    struct stat info;
+    bool is_directory = stat(input_path, &info) == 0 && S_ISDIR(info.st_mode);
+#endif
+#ifdef _WIN32
+    DWORD attributes = GetFileAttributes(input_path);
+    bool is_directory = attributes != INVALID_FILE_ATTRIBUTES &&
+                        (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#endif
+    if (is_directory)
+    {
+        batch_read_directory(&b, input_path, output_path);
+    }
+    else
+    {
+        batch_read_manifest(&b, input_path);
+    }
+    // Lines of the manifest which failed before the conversion
+    int rejected = b.failed;
+
+    int threads = opt->threads > 0 ? opt->threads : count_cores();
+    threads = threads > MAX_THREADS ? MAX_THREADS : threads;
+    threads = threads > b.count ? b.count : threads;
+
+    worker workers[MAX_THREADS];
+    for (int i = 0; i < threads; i++)
+    {
+        start_worker(&workers[i], batch_worker, &b);
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        join_worker(workers[i]);
+    }
+
+    printf("Converted %d of %d files\n", b.count + rejected - b.failed, b.count + rejected);
+    for (int i = 0; i < b.count; i++)
+    {
+        free(b.files[i].input);
+        free(b.files[i].output);
+    }
+    free(b.files);
+    return b.failed > 0 ? 1 : 0;
+}
+
+#ifdef linux
+#define SIP_ROTATE(x, b) ((x) << (b) | (x) >> (64 - (b)))
+
+static void sip_round(uint64_t v[4])
+{
+    v[0] += v[1];
+    v[1] = SIP_ROTATE(v[1], 13) ^ v[0];
+    v[0] = SIP_ROTATE(v[0], 32);
+    v[2] += v[3];
+    v[3] = SIP_ROTATE(v[3], 16) ^ v[2];
+    v[0] += v[3];
+    v[3] = SIP_ROTATE(v[3], 21) ^ v[0];
+    v[2] += v[1];
+    v[1] = SIP_ROTATE(v[1], 17) ^ v[2];
+    v[2] = SIP_ROTATE(v[2], 32);
+}
+
+// 128 bit SipHash-2-4 of 'data' keyed by 'hash', the result is stored to 'hash'. A
+// client which does not know the key can not make two images of the same hash.
+static void hash_data(const void *data, size_t size, uint64_t hash[2])
+{
+    const unsigned char *bytes = data;
+    uint64_t v[4] = {hash[0] ^ 0x736f6d6570736575ULL, hash[1] ^ 0x646f72616e646f6dULL ^ 0xee,
+                     hash[0] ^ 0x6c7967656e657261ULL, hash[1] ^ 0x7465646279746573ULL};
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        v[3] ^= word;
+        sip_round(v);
+        sip_round(v);
+        v[0] ^= word;
+    }
+    // The last word has the rest of the bytes and the size in its top byte
+    uint64_t word = (uint64_t)size << 56;
+    for (size_t k = 0; i + k < size; k++)
+    {
+        word |= (uint64_t)bytes[i + k] << (8 * k);
+    }
+    v[3] ^= word;
+    sip_round(v);
+    sip_round(v);
+    v[0] ^= word;
+
+    v[2] ^= 0xee;
+    for (int k = 0; k < 4; k++)
+    {
+        sip_round(v);
+    }
+    hash[0] = v[0] ^ v[1] ^ v[2] ^ v[3];
+    v[1] ^= 0xdd;
+    for (int k = 0; k < 4; k++)
+    {
+        sip_round(v);
+    }
+    hash[1] = v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+// Memory of an entry counted to the budget of the cache
+static size_t cache_entry_memory(cache_entry *entry)
+{
+    return sizeof(cache_entry) + entry->output_size + strlen(entry->char_set) + 1;
+}
+
+static void cache_init(cache *c, size_t budget)
+{
+    c->bucket_count = CACHE_BUCKETS_MIN;
+    c->buckets = calloc(c->bucket_count, sizeof(cache_entry *));
+    if (c->buckets == NULL)
+    {
+        error("Error: Could not allocate memory for cache \n");
+    }
+    c->count = 0;
+    c->newest = NULL;
+    c->oldest = NULL;
+    c->memory = 0;
+    c->budget = budget;
+    if (getrandom(c->key, sizeof(c->key), 0) != sizeof(c->key))
+    {
+        error("Error: Could not get a random key for cache \n");
+    }
+    pthread_mutex_init(&c->lock, NULL);
+}
+
+static void cache_unlink(cache *c, cache_entry *entry)
+{
+    *(entry->older != NULL ? &entry->older->newer : &c->oldest) = entry->newer;
+    *(entry->newer != NULL ? &entry->newer->older : &c->newest) = entry->older;
+}
+
+static void cache_push_newest(cache *c, cache_entry *entry)
+{
+    entry->older = c->newest;
+    entry->newer = NULL;
+    *(c->newest != NULL ? &c->newest->newer : &c->oldest) = entry;
+    c->newest = entry;
+}
+
+// Entry of the image and the options, it becomes the most recently used one.
+// Returns NULL if there is none.
+static cache_entry *cache_find(cache *c, uint64_t hash[2], size_t input_size, options *opt)
+{
+    cache_entry *entry = c->buckets[hash[0] & (c->bucket_count - 1)];
+    for (; entry != NULL; entry = entry->next)
+    {
+        if (entry->hash[0] == hash[0] && entry->hash[1] == hash[1] &&
+            entry->input_size == input_size && entry->gamma == opt->gamma &&
+            entry->cols == opt->cols && entry->rows == opt->rows &&
+            strcmp(entry->char_set, opt->char_set) == 0)
+        {
+            cache_unlink(c, entry);
+            cache_push_newest(c, entry);
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Drop the least recently used entry
+static void cache_drop_oldest(cache *c)
+{
+    cache_entry *entry = c->oldest;
+    cache_entry **link = &c->buckets[entry->hash[0] & (c->bucket_count - 1)];
+    while (*link != entry)
+    {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    cache_unlink(c, entry);
+    c->memory -= cache_entry_memory(entry);
+    c->count--;
+    free(entry->char_set);
+    free(entry->output);
+    free(entry);
+}
+
+// There are at most as many entries as buckets, so the buckets are short
+static void cache_grow(cache *c)
+{
+    size_t bucket_count = c->bucket_count * 2;
+    cache_entry **buckets = calloc(bucket_count, sizeof(cache_entry *));
+    if (buckets == NULL)
+    {
+        return;
+    }
+    for (size_t i = 0; i < c->bucket_count; i++)
+    {
+        cache_entry *entry = c->buckets[i];
+        while (entry != NULL)
+        {
+            cache_entry *next = entry->next;
+            cache_entry **bucket = &buckets[entry->hash[0] & (bucket_count - 1)];
+            entry->next = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+    free(c->buckets);
+    c->buckets = buckets;
+    c->bucket_count = bucket_count;
+}
+
+// Add 'output' of the image to the cache, it is owned by the cache then. Returns
+// false if it does not fit to the budget (or it is in the cache already), then the
+// caller keeps it.
+static bool cache_insert(cache *c, uint64_t hash[2], size_t input_size, options *opt, char *output,
+                         size_t output_size)
+{
+    size_t memory = sizeof(cache_entry) + output_size + strlen(opt->char_set) + 1;
+    if (memory > c->budget || cache_find(c, hash, input_size, opt) != NULL)
+    {
+        return false;
+    }
+
+    cache_entry *entry = malloc(sizeof(cache_entry));
+    char *char_set = malloc(strlen(opt->char_set) + 1);
+    if (entry == NULL || char_set == NULL)
+    {
+        free(entry);
+        free(char_set);
+        return false;
+    }
+    while (c->memory + memory > c->budget)
+    {
+        cache_drop_oldest(c);
+    }
+    if (c->count >= c->bucket_count)
+    {
+        cache_grow(c);
+    }
+
+    memcpy(entry->hash, hash, sizeof(entry->hash));
+    entry->input_size = input_size;
+    entry->char_set = strcpy(char_set, opt->char_set);
+    entry->gamma = opt->gamma;
+    entry->cols = opt->cols;
+    entry->rows = opt->rows;
+    entry->output = output;
+    entry->output_size = output_size;
+    cache_entry **bucket = &c->buckets[hash[0] & (c->bucket_count - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+    cache_push_newest(c, entry);
+    c->memory += memory;
+    c->count++;
+    return true;
+}
+
+// Make a buffer of the client at least 'size' bytes large, returns false if there
+// is not enough memory or the buffers of all clients would be over
+// REQUEST_MEMORY_MAX
+static bool connection_reserve(connection *conn, char **buffer, size_t *capacity, size_t size)
+{
+    if (size <= *capacity)
+    {
+        return true;
+    }
+    server *s = conn->server;
+    size_t growth = size - *capacity;
+    pthread_mutex_lock(&s->lock);
+    bool fits = growth <= REQUEST_MEMORY_MAX - s->memory;
+    if (fits)
+    {
+        s->memory += growth;
+    }
+    pthread_mutex_unlock(&s->lock);
+    char *larger = fits ? realloc(*buffer, size) : NULL;
+    if (larger == NULL)
+    {
+        if (fits)
+        {
+            pthread_mutex_lock(&s->lock);
+            s->memory -= growth;
+            pthread_mutex_unlock(&s->lock);
+        }
+        return false;
+    }
+    *buffer = larger;
+    *capacity = size;
+    return true;
+}
+
+// Read 'size' bytes from the client, first the ones which were received already.
+// Returns false if the client closed the connection.
+static bool connection_read(connection *conn, char *buffer, size_t size)
+{
+    size_t count = conn->end - conn->start < size ? conn->end - conn->start : size;
+    memcpy(buffer, conn->in + conn->start, count);
+    conn->start += count;
+    while (count < size)
+    {
+        ssize_t length = recv(conn->fd, buffer + count, size - count, 0);
+        if (length < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (length <= 0)
+        {
+            return false;
+        }
+        count += length;
+    }
+    return true;
+}
+
+// Skip 'size' bytes from the client, returns false if the client closed the
+// connection
+static bool connection_skip(connection *conn, size_t size)
+{
+    while (true)
+    {
+        size_t count = conn->end - conn->start < size ? conn->end - conn->start : size;
+        conn->start += count;
+        size -= count;
+        if (size == 0)
+        {
+            return true;
+        }
+
+        ssize_t received = recv(conn->fd, conn->in, REQUEST_BUFFER_SIZE, 0);
+        if (received < 0 && errno == EINTR)
+        {
+            received = 0;
+        }
+        else if (received <= 0)
+        {
+            return false;
+        }
+        conn->start = 0;
+        conn->end = received;
+    }
+}
+
+// Read a line of at most 'size' - 1 bytes without the new line, returns false if
+// the line is longer or the client closed the connection
+static bool connection_read_line(connection *conn, char *line, size_t size)
+{
+    size_t length = 0;
+    while (true)
+    {
+        for (; conn->start < conn->end; conn->start++)
+        {
+            char c = conn->in[conn->start];
+            if (c == '\n')
+            {
+                conn->start++;
+                line[length] = '\0';
+                return true;
+            }
+            if (length == size - 1)
+            {
+                return false;
+            }
+            line[length++] = c;
+        }
+
+        ssize_t received = recv(conn->fd, conn->in, REQUEST_BUFFER_SIZE, 0);
+        if (received < 0 && errno == EINTR)
+        {
+            received = 0;
+        }
+        else if (received <= 0)
+        {
+            return false;
+        }
+        conn->start = 0;
+        conn->end = received;
+    }
+}
+
+static bool connection_send(connection *conn, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t length = send(conn->fd, data, size, MSG_NOSIGNAL);
+        if (length < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (length <= 0)
+        {
+            return false;
+        }
+        data += length;
+        size -= length;
+    }
+    return true;
+}
+
+// Read the whole file of a PATH request to 'conn->image'
+static pgm_status connection_read_file(connection *conn, const char *path, size_t *size)
+{
+    FILE *input = fopen(path, "rb");
+    if (input == NULL)
+    {
+        return PGM_ERROR_OPEN;
+    }
+
+    pgm_status status = PGM_OK;
+    *size = 0;
+    while (status == PGM_OK)
+    {
+        if (*size == conn->image_capacity &&
+            !connection_reserve(conn, &conn->image, &conn->image_capacity,
+                                conn->image_capacity > 0 ? 2 * conn->image_capacity
+                                                         : CHUNK_SIZE))
+        {
+            status = PGM_ERROR_MEMORY;
+            break;
+        }
+        size_t length = read_chunk(input, conn->image + *size, conn->image_capacity - *size,
+                                   &status);
+        *size += length;
+        if (*size < conn->image_capacity)
+        {
+            break;
+        }
+    }
+    fclose(input);
+    return status;
+}
+
+// Copy the output of the image with the options from the cache to 'conn->output',
+// or convert it if it is not there and add it to the cache
+static pgm_status serve_image(connection *conn, const char *data, size_t size, options *opt)
+{
+    // The options are hashed with the hash of the image (and the options before
+    // them) as the key
+    cache *c = &conn->server->cache;
+    uint64_t hash[2] = {c->key[0], c->key[1]};
+    hash_data(data, size, hash);
+    hash_data(opt->char_set, strlen(opt->char_set), hash);
+    int dimensions[2] = {opt->cols, opt->rows};
+    hash_data(&opt->gamma, sizeof(opt->gamma), hash);
+    hash_data(dimensions, sizeof(dimensions), hash);
+
+    pgm_status status = PGM_OK;
+    pthread_mutex_lock(&c->lock);
+    cache_entry *entry = cache_find(c, hash, size, opt);
+    if (entry != NULL)
+    {
+        if (connection_reserve(conn, &conn->output, &conn->output_capacity, entry->output_size))
+        {
+            memcpy(conn->output, entry->output, entry->output_size);
+            conn->output_size = entry->output_size;
+        }
+        else
+        {
+            status = PGM_ERROR_MEMORY;
+        }
+        pthread_mutex_unlock(&c->lock);
+        return status;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    pgm image;
+    pgm_header header;
+    if ((status = parse_whole_header(data, size, &header)) != PGM_OK)
+    {
+        return status;
+    }
+    image.header = &header;
+    image.file.data = (char *)data;
+    image.file.size = size;
+    image.file.fd = -1;
+    if (!connection_reserve(conn, &conn->output, &conn->output_capacity,
+                            calc_output_size(&header, opt)))
+    {
+        return PGM_ERROR_MEMORY;
+    }
+    size_t written = convert_pgm_to_ascii(image, opt, conn->output, &status);
+    if (status != PGM_OK)
+    {
+        return status;
+    }
+    conn->output_size = written;
+
+    // The cache keeps a copy, the memory of the cache has a budget of its own
+    char *output = malloc(written);
+    if (output == NULL)
+    {
+        return PGM_OK;
+    }
+    memcpy(output, conn->output, written);
+    pthread_mutex_lock(&c->lock);
+    bool cached = cache_insert(c, hash, size, opt, output, written);
+    pthread_mutex_unlock(&c->lock);
+    if (!cached)
+    {
+        free(output);
+    }
+    return PGM_OK;
+}
+
+// Serve a request of 'kind' with the path or the image of 'size' bytes in
+// 'conn->data'
+static pgm_status serve_request(connection *conn, const char *kind, size_t size,
+                                options *opt)
+{
+    if (!is_charset_length_correct(opt->char_set) || !(opt->gamma > 0) || opt->cols < 0 ||
+        opt->cols > UINT16_MAX || opt->rows < 0 || opt->rows > UINT16_MAX)
+    {
+        return PGM_ERROR_OPTIONS;
+    }
+    if (strcmp(kind, REQUEST_PATH) == 0)
+    {
+        size_t image_size;
+        pgm_status status = connection_read_file(conn, conn->data, &image_size);
+        if (status != PGM_OK)
+        {
+            return status;
+        }
+        return serve_image(conn, conn->image, image_size, opt);
+    }
+    return serve_image(conn, conn->data, size, opt);
+}
+
+// Requests of a client, one after another until it closes the connection. Every
+// request is a line
+//     PATH|DATA <char set length> <gamma> <cols> <rows> <length>
+// followed by the char set and by the path of the image (PATH) or the image (DATA)
+// of the given lengths. The response is a line
+//     <status> <length>
+// followed by the output, or by the reason of the failure if the status is not 0.
+static WORKER_RESULT serve_connection(void *arg)
+{
+    connection *conn = arg;
+    char line[REQUEST_LINE_MAX];
+    while (connection_read_line(conn, line, sizeof(line)))
+    {
+        char kind[8];
+        size_t char_set_length, size;
+        options opt;
+        memset(&opt, 0, sizeof(opt));
+        opt.threads = 1;
+        if (sscanf(line, "%7s %zu %lf %d %d %zu", kind, &char_set_length, &opt.gamma,
+                   &opt.cols, &opt.rows, &size) != 6 ||
+            (strcmp(kind, REQUEST_PATH) != 0 && strcmp(kind, REQUEST_DATA) != 0) ||
+            char_set_length > CHAR_SET_MAX_LENGTH || size > REQUEST_MAX_SIZE)
+        {
+            break;
+        }
+
+        char *char_set = realloc(conn->char_set, char_set_length + 1);
+        if (char_set == NULL)
+        {
+            break;
+        }
+        conn->char_set = char_set;
+        if (!connection_read(conn, char_set, char_set_length))
+        {
+            break;
+        }
+        char_set[char_set_length] = '\0';
+        opt.char_set = char_set;
+
+        pgm_status status;
+        if (connection_reserve(conn, &conn->data, &conn->data_capacity, size + 1))
+        {
+            if (!connection_read(conn, conn->data, size))
+            {
+                break;
+            }
+            conn->data[size] = '\0';
+            status = serve_request(conn, kind, size, &opt);
+        }
+        else
+        {
+            // A request over the memory of the clients is skipped and refused
+            if (!connection_skip(conn, size))
+            {
+                break;
+            }
+            status = PGM_ERROR_MEMORY;
+        }
+
+        const char *body = status == PGM_OK ? conn->output : pgm_status_message(status);
+        size_t body_size = status == PGM_OK ? conn->output_size : strlen(body);
+        int length = snprintf(line, sizeof(line), "%d %zu\n", status, body_size);
+        if (!connection_send(conn, line, length) || !connection_send(conn, body, body_size))
+        {
+            break;
+        }
+    }
+
+    close(conn->fd);
+    free(conn->char_set);
+    free(conn->data);
+    free(conn->image);
+    free(conn->output);
+
+    server *s = conn->server;
+    pthread_mutex_lock(&s->lock);
+    s->memory -= conn->data_capacity + conn->image_capacity + conn->output_capacity;
+    s->connections--;
+    pthread_cond_signal(&s->left);
+    pthread_mutex_unlock(&s->lock);
+    free(conn);
+    return 0;
+}
+
+// Serve requests on the Unix socket at 'socket_path' until the process is killed,
+// every client has its own thread, all of them share the cache. At most
+// CONNECTION_MAX clients are served at a time.
+static int serve(char *socket_path, options *opt)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path))
+    {
+        errorf("Error: The socket path is too long: %s\n", socket_path);
+    }
+    strcpy(address.sun_path, socket_path);
+
+    // The socket of a previous daemon is replaced, other files are not
+    struct stat info;
+    if (stat(socket_path, &info) == 0 && S_ISSOCK(info.st_mode))
+    {
+        unlink(socket_path);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(fd, SOMAXCONN) != 0)
+    {
+        errorf("Error: Could not listen on socket: %s\n", socket_path);
+    }
+
+    server s;
+    cache_init(&s.cache, opt->cache_size);
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.left, NULL);
+    s.connections = 0;
+    s.memory = 0;
+    printf("Listening on %s with a cache of %zu MB\n", socket_path, opt->cache_size >> 20);
+    fflush(stdout);
+
+    while (true)
+    {
+        // The next client waits in the backlog of the socket until one leaves
+        pthread_mutex_lock(&s.lock);
+        while (s.connections >= CONNECTION_MAX)
+        {
+            pthread_cond_wait(&s.left, &s.lock);
+        }
+        pthread_mutex_unlock(&s.lock);
+
+        int client = accept(fd, NULL, NULL);
+        if (client < 0)
+        {
+            continue;
+        }
+        connection *conn = calloc(1, sizeof(connection));
+        pthread_t thread;
+        if (conn == NULL)
+        {
+            close(client);
+            continue;
+        }
+        conn->fd = client;
+        conn->server = &s;
+        pthread_mutex_lock(&s.lock);
+        s.connections++;
+        pthread_mutex_unlock(&s.lock);
+        if (pthread_create(&thread, NULL, serve_connection, conn) != 0)
+        {
+            pthread_mutex_lock(&s.lock);
+            s.connections--;
+            pthread_mutex_unlock(&s.lock);
+            close(client);
+            free(conn);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    options opt;
+    opt.gamma = 1.0;
+    // 0 means one thread, or one per core in the batch mode
+    opt.threads = 0;
+    opt.cols = 0;
+    opt.rows = 0;
+    opt.batch = false;
+    opt.frames = false;
+    opt.delta = false;
+    opt.serve = false;
+    opt.cache_size = (size_t)CACHE_SIZE_DEFAULT << 20;
 #if STD_OUT
-    printf("\n\nLength of output buffer: %d\n\n", pgm.header->x * pgm.header->y);
+    char *arg_input_file_path = "input.pgm";
+    char *arg_output_file_path = "output.txt";
+    char *arg_char_set = " .-+=o*O#@";
+#else
+    // options are before the other arguments, all of them but --batch, --frames,
+    // --delta and --daemon have a value
+    while (argc > 2 && strncmp(argv[1], "--", 2) == 0)
+    {
+        char *end;
+        int used = 2;
+        if (strcmp(argv[1], ARG_BATCH) == 0)
+        {
+            opt.batch = true;
+            used = 1;
+        }
+        else if (strcmp(argv[1], ARG_FRAMES) == 0 || strcmp(argv[1], ARG_DELTA) == 0)
+        {
+            opt.frames = true;
+            opt.delta = opt.delta || strcmp(argv[1], ARG_DELTA) == 0;
+            used = 1;
+        }
+        else if (strcmp(argv[1], ARG_DAEMON) == 0)
+        {
+            opt.serve = true;
+            used = 1;
+        }
+        else if (strcmp(argv[1], ARG_CACHE) == 0)
+        {
+            long megabytes = strtol(argv[2], &end, 10);
+            if (*end != '\0' || megabytes < 1 || megabytes > (long)(SIZE_MAX >> 21))
+                usage_is_wrong(argv[ARG_COMMAND]);
+            opt.cache_size = (size_t)megabytes << 20;
+        }
+        else if (strcmp(argv[1], ARG_THREADS) == 0)
+        {
+            long threads = strtol(argv[2], &end, 10);
+            if (*end != '\0' || threads < 1 || threads > MAX_THREADS)
+                usage_is_wrong(argv[ARG_COMMAND]);
+            opt.threads = threads;
+        }
+        else if (strcmp(argv[1], ARG_GAMMA) == 0)
+        {
+            opt.gamma = strtod(argv[2], &end);
+            if (*end != '\0' || !(opt.gamma > 0))
+                usage_is_wrong(argv[ARG_COMMAND]);
+        }
+        else if (strcmp(argv[1], ARG_COLS) == 0 || strcmp(argv[1], ARG_ROWS) == 0)
+        {
+            long size = strtol(argv[2], &end, 10);
+            if (*end != '\0' || size < 1 || size > UINT16_MAX)
+                usage_is_wrong(argv[ARG_COMMAND]);
+            *(strcmp(argv[1], ARG_COLS) == 0 ? &opt.cols : &opt.rows) = size;
+        }
+        else
+        {
+            usage_is_wrong(argv[ARG_COMMAND]);
+        }
+        argv[used] = argv[ARG_COMMAND];
+        argv += used;
+        argc -= used;
+    }
+
+    // The daemon has only the socket, the char set and the options are in requests
+    if (opt.serve)
+    {
+        if (argc != 2)
+            usage_is_wrong(argv[ARG_COMMAND]);
+#ifdef linux
+        return serve(argv[1], &opt);
+#endif
+#ifdef _WIN32
+        error("Error: The daemon is supported only in linux \n");
 #endif
+    }
 
-    convert_pgm_to_ascii(pgm, arg_char_set, output_buffer);
+    // check if the number of arguments is correct
+    if (argc != ARG_COUNT)
+        usage_is_wrong(argv[ARG_COMMAND]);
 
-#if STD_OUT
-    printf("ASCII output:\n%s\n\n", output_buffer);
+    // args
+    char *arg_input_file_path = argv[ARG_INPUT];
+    char *arg_output_file_path = argv[ARG_OUTPUT];
+    char *arg_char_set = argv[ARG_CHAR_SET];
 #endif
+    opt.char_set = arg_char_set;
+
+    // check char set length
+    if (!is_charset_length_correct(opt.char_set))
+    {
+        char_set_is_wrong();
+    }
+
+    if (opt.batch)
+    {
+        return convert_batch(arg_input_file_path, arg_output_file_path, &opt);
+    }
 
-    // write the output file
-    write_file(arg_output_file_path, output_buffer, output_buffer_size);
+    // PATH_STD means standard input or output
+    bool is_input_std = strcmp(arg_input_file_path, PATH_STD) == 0;
+    bool is_output_std = strcmp(arg_output_file_path, PATH_STD) == 0;
+    // Images of --frames are found while the input is read, so it is streamed
+    if (!opt.frames && !is_input_std && !is_output_std &&
+        can_map_file(arg_input_file_path, false) && can_map_file(arg_output_file_path, true))
+    {
+        convert_mapped(arg_input_file_path, arg_output_file_path, &opt);
+        return 0;
+    }
 
-    // free memory
-    free(output_buffer);
-    free(pgm.header);
+    // open the files
+    FILE *input = is_input_std ? stdin : fopen(arg_input_file_path, "rb");
+    if (input == NULL)
+    {
+        errorf("Unable to open: %s\n", arg_input_file_path);
+    }
+    // text mode writes SYMBOL_NEW_LINE for every new line
+    FILE *output = is_output_std ? stdout : fopen(arg_output_file_path, "w");
+    if (output == NULL)
+    {
+        errorf("Unable to create file: %s\n", arg_output_file_path);
+    }
+
+    // Rows of the downscaled image are sums of many rows, they are made by one thread,
+    // so are the images of --frames
+    if (opt.threads > 1 && opt.cols == 0 && opt.rows == 0 && !opt.frames)
+    {
+        convert_stream_threads(input, output, &opt);
+    }
+    else
+    {
+        convert_stream(input, output, &opt);
+    }
+
+    // close the files
+    if (!is_input_std)
+    {
+        fclose(input);
+    }
+    if (fflush(output) != 0 || (!is_output_std && fclose(output) != 0))
+    {
+        error("Error: Could not write the output file \n");
+    }
 
     return 0;
 }
+#endif
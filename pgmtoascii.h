@@ -0,0 +1,76 @@
+//
+// author: Tomáš Petržela
+// e-mail: tomas.petrzela02 at upol.cz
+//
+// pgmtoascii library - convert a PGM image in memory to ASCII art
+//
+// petrzela-tomas-2-any.c compiled with -DPGMTOASCII_LIBRARY has no main, it can be
+// linked to another program which converts images without starting a process for
+// every image. Only the functions below are exported. The functions return the
+// reason of a failure, they never exit.
+//
+// A context keeps the options, the table of characters of the gray levels and the
+// buffer of the downscaling, so a conversion allocates nothing. The table is
+// computed again only when the number of gray levels of the image changes. A
+// context may be used by one thread at a time, use one context per thread.
+//
+// Usage example:
+//      pgm_status status;
+//      pgm_context *context = pgm_context_create(" .-+=o*O#@", 1.0, 0, 0, &status);
+//      size_t size, written;
+//      if (pgm_output_size(context, data, data_size, &size) == PGM_OK)
+//      {
+//          char *output = malloc(size);
+//          status = pgm_convert(context, data, data_size, output, size, &written);
+//      }
+//      pgm_context_destroy(context);
+//
+#ifndef PGMTOASCII_H
+#define PGMTOASCII_H
+
+#include <stddef.h>
+
+// Result of the parsing, the caller decides how to report errors
+typedef enum
+{
+    PGM_OK,
+    PGM_INCOMPLETE,
+    PGM_ERROR_MARKER,
+    PGM_ERROR_HEADER,
+    PGM_ERROR_DATA,
+    PGM_ERROR_OVER_SCALE,
+    PGM_ERROR_TRUNCATED,
+    PGM_ERROR_OPEN,
+    PGM_ERROR_READ,
+    PGM_ERROR_WRITE,
+    PGM_ERROR_OPTIONS,
+    PGM_ERROR_MEMORY,
+    PGM_ERROR_OUTPUT_SIZE,
+    PGM_ERROR_LEFTOVER,
+} pgm_status;
+
+typedef struct pgm_context pgm_context;
+
+// Create a context for 'char_set' (it is copied), 'gamma' and the size of the
+// downscaled image, 'cols' and 'rows' are the same as --cols and --rows, 0 means
+// not given. Returns NULL and sets 'status' if the options are not valid or there
+// is not enough memory.
+pgm_context *pgm_context_create(const char *char_set, double gamma, int cols, int rows,
+                                pgm_status *status);
+
+void pgm_context_destroy(pgm_context *context);
+
+// Size of the output of the pgm image in 'data', only its header is parsed
+pgm_status pgm_output_size(pgm_context *context, const char *data, size_t size,
+                           size_t *output_size);
+
+// Convert the whole pgm image in 'data' to 'output' of 'capacity' bytes, at least
+// pgm_output_size. 'written' is set to number of bytes stored to 'output', if the
+// conversion fails, the output has what was converted before.
+pgm_status pgm_convert(pgm_context *context, const char *data, size_t size, char *output,
+                       size_t capacity, size_t *written);
+
+// Reason of the failure of the conversion, it ends with a new line
+const char *pgm_status_message(pgm_status status);
+
+#endif